@@ -1,15 +1,47 @@
 #include <iostream>
 #include <vector>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <cctype>
+#include <type_traits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <map>
+#include <bitset>
+#include <array>
 #ifdef _WIN32
 #include <conio.h>
 #elif defined(linux) || defined(APPLE)
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#include <climits>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
 #endif
 using namespace std;
 
@@ -20,1307 +52,6418 @@ struct EditorStatus {
 	size_t cursorColumn;    // Current column number
 	size_t totalLines;      // Total lines in the document
 	string lastCommand;     // Last executed command
+	size_t matchNumber;     // Search match the cursor is on (1-based)
+	size_t matchCount;      // Matches of the last search, 0 when stale
 };
-struct node {
-public:
-	char data;
-	node* next;
-	node* previous;
-	node(char a) : data(a), next(nullptr), previous(nullptr) {}
-};
-class SearchEngine {
+
+// Read-only contents of a loaded file. Small files are read into memory;
+// large ones are memory-mapped so opening them only costs the line-feed
+// scan, and pages are faulted in when a line is displayed, searched or edited.
+class FileBuffer {
+	string owned;
+	const char* mapped;
+	size_t mappedSize;
+	int mappedFd;       // Kept open so saves can copy from the old file
+
 public:
-	string lastPattern;
-	size_t lastMatchLine;
-	size_t lastMatchColumn;
-	SearchEngine() : lastMatchLine(0), lastMatchColumn(0) {}
+	FileBuffer() : mapped(nullptr), mappedSize(0), mappedFd(-1) {}
+	FileBuffer(const FileBuffer&) = delete;
+	FileBuffer& operator=(const FileBuffer&) = delete;
+	~FileBuffer() {
+		release();
+	}
 
-	bool search(const vector<node*>& lines, const string& str) {
-		lastPattern = str;
-		for (size_t i = 0; i < lines.size(); ++i) {
-			node* current = lines[i];
-			size_t column = 0;
-			while (current) {
-				node* temp = current;
-				size_t j = 0;
-				while (temp && j < str.size() && temp->data == str[j]) {
-					temp = temp->next;
-					j++;
-				}
-				if (j == str.size()) { // Found a match
-					lastMatchLine = i;
-					lastMatchColumn = column;
-					return true;
-				}
-				current = current->next;
-				column++;
-			}
-		}
-		lastMatchLine = 0;
-		lastMatchColumn = 0;
-		return false;
+	const char* data() const {
+		return mapped ? mapped : owned.data();
+	}
+	size_t size() const {
+		return mapped ? mappedSize : owned.size();
+	}
+	bool isMapped() const {
+		return mapped != nullptr;
+	}
+	int fd() const {
+		return mappedFd;
+	}
+	// Heap bytes held; mapped pages belong to the page cache
+	size_t heapBytes() const {
+		return owned.capacity();
 	}
 
+	void assign(string&& content) {
+		release();
+		owned = move(content);
+	}
 
-	bool findNext(const vector<node*>& lines) {
-		// Implement logic to find the next occurrence of lastPattern
-		for (int i = lastMatchLine; i < lines.size(); ++i) {
-			node* current = lines[i];
-			int column = (i == lastMatchLine) ? lastMatchColumn : 0;
-			while (current) {
-				if (current->data == lastPattern[0]) {
-					node* temp = current;
-					size_t j = 0;
-					while (temp && j < lastPattern.size() && temp->data == lastPattern[j]) {
-						temp = temp->next;
-						j++;
-					}
-					if (j == lastPattern.size()) {
-						lastMatchLine = i;
-						lastMatchColumn = column;
-						return true;
-					}
-				}
-				current = current->next;
-				column++;
-			}
+	bool map(const string& filename) {
+		release();
+#if defined(linux) || defined(APPLE)
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+			close(fd);
+			return false;
+		}
+		void* region = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (region == MAP_FAILED) {
+			close(fd);
+			return false;
 		}
-		return false; // No more occurrences found
+		mapped = static_cast<const char*>(region);
+		mappedSize = info.st_size;
+		mappedFd = fd;
+		return true;
+#else
+		return false;
+#endif
 	}
 
-	bool findPrevious(const vector<node*>& lines) {
-		for (size_t i = lastMatchLine; i < lines.size(); ++i) {
-			node* current = lines[i];
-			size_t column = (i == lastMatchLine) ? lastMatchColumn : 0;
-			while (current) {
-				if (current->data == lastPattern[0]) {
-					node* temp = current;
-					size_t j = 0;
-					while (temp&& j < lastPattern.size() && temp->data == lastPattern[j]) {
-						temp = temp->next;
-						j++;
-					}
-					if (j == lastPattern.size()) {
-						lastMatchLine = i;
-						lastMatchColumn = column;
-						return true;
-					}
-				}
-				current = current->next;
-				column++;
-			}
+	// Lets the kernel drop already scanned pages from our resident set; they
+	// come back from the page cache when touched again.
+	void dropPages(size_t offset, size_t length) {
+#if defined(linux) || defined(APPLE)
+		if (!mapped) return;
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t first = offset / page * page;
+		size_t last = (offset + length) / page * page;
+		if (last > first) {
+			madvise(const_cast<char*>(mapped) + first, last - first, MADV_DONTNEED);
 		}
+#endif
+	}
 
-		// If we reach here, we need to check previous lines
-		for (size_t i = lastMatchLine; i-- > 0;) {
-			node* current = lines[i];
-			size_t column = 0;
-			while (current) {
-				if (current->data == lastPattern[0]) {
-					node* temp = current;
-					size_t j = 0;
-					while (temp && j < lastPattern.size() && temp->data == lastPattern[j]) {
-						temp = temp->next;
-						j++;
-					}
-					if (j == lastPattern.size()) {
-						lastMatchLine = i;
-						lastMatchColumn = column;
-						return true;
-					}
-				}
-				current = current->next;
-				column++;
-			}
+	// Gives the mapping its own copy of every page, so rewriting the file
+	// in place leaves these bytes as they were. The address stays the same
+	// for readers on other threads; the file is no longer copied from.
+	bool keepPrivate() {
+#if defined(linux) || defined(APPLE)
+		if (!mapped) return true;
+		char* region = const_cast<char*>(mapped);
+		if (mprotect(region, mappedSize, PROT_READ | PROT_WRITE) != 0) {
+			return false;
+		}
+		size_t page = sysconf(_SC_PAGESIZE);
+		for (size_t offset = 0; offset < mappedSize; offset += page) {
+			volatile char* byte = region + offset;
+			*byte = *byte;   // Copy-on-write detaches the page from the file
 		}
-		return false; // No previous occurrences found
+		mprotect(region, mappedSize, PROT_READ);
+		close(mappedFd);
+		mappedFd = -1;
+#endif
+		return true;
 	}
 
-	bool replace(vector<node*>& lines, const string& oldStr, const string& newStr, bool global = false) {
-		if (lines.empty() || oldStr.empty()) return false;
-		bool replaced = false;
-
-		for (size_t i = 0; i < lines.size(); ++i) {
-			node* current = lines[i];
-			string lineContent;
-
-			// Build string from linked list
-			while (current) {
-				lineContent += current->data;
-				current = current->next;
-			}
+	void release() {
+#if defined(linux) || defined(APPLE)
+		if (mapped) {
+			munmap(const_cast<char*>(mapped), mappedSize);
+			if (mappedFd >= 0) close(mappedFd);
+		}
+#endif
+		mapped = nullptr;
+		mappedFd = -1;
+		mappedSize = 0;
+		string().swap(owned);
+	}
+};
 
-			size_t pos = lineContent.find(oldStr);
-			if (pos != string::npos) {
-				replaced = true;
+// Hands out fixed-size nodes carved from large contiguous slabs instead of
+// one heap allocation per node. releaseAll() drops every node at once and
+// keeps the first slab around for the next document.
+template <typename T>
+class NodePool {
+	static_assert(is_trivially_destructible<T>::value, "pooled nodes are never destroyed one by one");
+	static constexpr size_t SLAB_NODES = 4096;
+	vector<T*> slabs;
+	size_t usedInLastSlab;
 
-				do {
-					lineContent.replace(pos, oldStr.size(), newStr);
-					pos = global ? lineContent.find(oldStr, pos + newStr.size()) : string::npos;
-				} while (global && pos != string::npos);
+public:
+	NodePool() : usedInLastSlab(SLAB_NODES) {}
+	NodePool(const NodePool&) = delete;
+	NodePool& operator=(const NodePool&) = delete;
+	~NodePool() {
+		for (T* slab : slabs) {
+			delete[] slab;
+		}
+	}
 
-				// Rebuild the linked list
-				node* newLine = nullptr;
-				node* prev = nullptr;
-				for (char ch : lineContent) {
-					node* newNode = new node(ch);
-					if (!newLine) newLine = newNode;
-					if (prev) prev->next = newNode;
-					newNode->previous = prev;
-					prev = newNode;
-				}
+	T* allocate() {
+		if (usedInLastSlab == SLAB_NODES) {
+			slabs.push_back(new T[SLAB_NODES]);
+			usedInLastSlab = 0;
+		}
+		return &slabs.back()[usedInLastSlab++];
+	}
 
-				// Delete the old line and assign the new one
-				current = lines[i];
-				while (current) {
-					node* toDelete = current;
-					current = current->next;
-					delete toDelete;
-				}
-				lines[i] = newLine;
-			}
-			if (!global && replaced) break;
+	void releaseAll() {
+		for (size_t i = 1; i < slabs.size(); ++i) {
+			delete[] slabs[i];
 		}
-		return replaced;
+		slabs.resize(min<size_t>(slabs.size(), 1));
+		usedInLastSlab = slabs.empty() ? SLAB_NODES : 0;
 	}
 
+	size_t bytesReserved() const {
+		return slabs.size() * SLAB_NODES * sizeof(T);
+	}
 };
-class FileManager {
-private:
-	string currentFileName;
-	bool modified;
 
-public:
-	FileManager() : currentFileName(""), modified(false) {}
+// Hash of a byte stream that may arrive in pieces of any size: the bytes
+// read as a polynomial in BASE, modulo the prime 2^61 - 1. The hash of two
+// texts joined follows from their hashes and the length of the second (see
+// append()), so a document made of pieces is hashed without reading the
+// pieces whose hash is already known. Leading zero bytes do not change the
+// hash, so lengths are compared along with it.
+class ContentHash {
+	static constexpr uint64_t MODULUS = (uint64_t(1) << 61) - 1;
+	static constexpr uint64_t BASE = 0x16A09E667F3BCC9ull;
+	uint64_t state;
 
-	bool loadFile(const string& filename, vector<node*>& lines) {
-		ifstream file(filename);
-		if (!file.is_open()) {
-			return false;
-		}
-		lines.clear();
-		string lineContent;
-		while (getline(file, lineContent)) {
-			node* lineStart = nullptr;
-			node* current = nullptr;
-			for (char ch : lineContent) {
-				node* newNode = new node(ch);
-				if (!lineStart) {
-					lineStart = newNode;
-				}
-				else {
-					current->next = newNode;
-					newNode->previous = current;
-				}
-				current = newNode;
+	static uint64_t reduce(uint64_t value) {
+		value = (value & MODULUS) + (value >> 61);
+		return value >= MODULUS ? value - MODULUS : value;
+	}
+	// a * b modulo MODULUS, for a and b below it
+	static uint64_t multiply(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+		unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+		return reduce((uint64_t(product) & MODULUS) + uint64_t(product >> 61));
+#else
+		// From 32-bit halves, with 2^64 = 8 and 2^61 = 1 modulo MODULUS
+		uint64_t aHigh = a >> 32, aLow = a & 0xFFFFFFFF, bHigh = b >> 32, bLow = b & 0xFFFFFFFF;
+		uint64_t middle = aHigh * bLow + aLow * bHigh;
+		uint64_t sum = (aHigh * bHigh << 3) + (middle >> 29) + ((middle & 0x1FFFFFFF) << 32) + reduce(aLow * bLow);
+		return reduce(reduce(sum));
+#endif
+	}
+	// BASE to the power `n`, from its squarings
+	static uint64_t power(uint64_t n) {
+		static const vector<uint64_t> squarings = [] {
+			vector<uint64_t> powers(1, BASE);
+			for (int i = 1; i < 64; ++i) {
+				powers.push_back(multiply(powers.back(), powers.back()));
 			}
-			lines.push_back(lineStart);
+			return powers;
+			}();
+		uint64_t result = 1;
+		for (int i = 0; n > 0; ++i, n >>= 1) {
+			if (n & 1) result = multiply(result, squarings[i]);
 		}
-		file.close();
-		currentFileName = filename;
-		modified = false;
-		return true;
+		return result;
 	}
 
-	bool saveFile(const string& filename, const vector<node*>& lines) {
-		ofstream file(filename);
-		if (!file.is_open()) {
-			return false;
-		}
+public:
+	ContentHash() : state(0) {}
 
-		for (node* line : lines) {
-			node* current = line;
-			while (current) {
-				file << current->data;
-				current = current->next;
+	void add(const char* data, size_t length) {
+		// Eight bytes at a time: their terms are independent, so the
+		// multiplies overlap
+		static const uint64_t baseToThe8 = power(8);
+		static const array<uint64_t, 8> lanes = [] {
+			array<uint64_t, 8> powers;
+			for (int i = 0; i < 8; ++i) powers[i] = power(7 - i);
+			return powers;
+			}();
+		for (; length >= 8; data += 8, length -= 8) {
+#if defined(__SIZEOF_INT128__)
+			unsigned __int128 sum = 0;
+			for (int i = 0; i < 8; ++i) {
+				sum += static_cast<unsigned __int128>(lanes[i]) * static_cast<unsigned char>(data[i]);
+			}
+			uint64_t block = reduce((uint64_t(sum) & MODULUS) + uint64_t(sum >> 61));
+#else
+			uint64_t block = 0;
+			for (int i = 0; i < 8; ++i) {
+				block += multiply(lanes[i], static_cast<unsigned char>(data[i]));
 			}
-			file << '\n';
+			block = reduce(block);
+#endif
+			state = reduce(multiply(state, baseToThe8) + block);
+		}
+		for (; length > 0; --length) {
+			state = reduce(multiply(state, BASE) + static_cast<unsigned char>(*data++));
 		}
-		file.close();
-		currentFileName = filename;
-		modified = false;
-		return true;
-	}
-
-	void markAsModified() {
-		modified = true;
 	}
-	bool hasUnsavedChanges() {
-		return modified;
+	// Continues with `length` bytes whose hash is `hash`
+	void append(uint64_t hash, uint64_t length) {
+		state = reduce(multiply(state, power(length)) + hash);
 	}
-	string getCurrentFileName() {
-		return currentFileName;
+	uint64_t finish() const {
+		return state;
 	}
-};
 
-class TextEditor {
-	vector<node*> lines;
-	int current_line;
-	node* Cursor;
-	bool insertMode;
-	string copyBuffer;
-	EditorStatus status;
-	FileManager fileManager;
-	SearchEngine searchEngine;
-	bool isWordCharacter(char c) {
-		if ((c >= 65 && c <= 90) || (c >= 97 && c <= 122)) {
-			return true;
-		}
-		return false;
+	// Hash of the bytes after the first ones in a text, from the hash of the
+	// whole text, that of its first bytes and the number of bytes after them
+	static uint64_t rest(uint64_t whole, uint64_t first, uint64_t restLength) {
+		return reduce(whole + MODULUS - multiply(first, power(restLength)));
 	}
-	bool isPunctuation(char c) {
-		if ((c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c == ' ')) {
-			return true;
-		}
-		return false;
+	static uint64_t of(string_view text) {
+		ContentHash hash;
+		hash.add(text.data(), text.size());
+		return hash.finish();
 	}
+};
 
+// The document is kept as a piece table: the loaded file stays untouched in
+// `original`, every inserted byte is appended to `added`, and the text is the
+// concatenation of the pieces. Lines are separated by '\n' (no trailing one).
+// Pieces live in a treap ordered by position whose nodes also carry the
+// length and line-feed count of their subtree, so finding an offset or the
+// start of any line, and inserting or removing text, are O(log pieces).
+class PieceTable {
 public:
-	TextEditor() : current_line(0), Cursor(nullptr), insertMode(false) {
-		lines.push_back(nullptr);
-		updateStatus();
-	}
-	void joinLines() {
-		if (current_line < lines.size() - 1) {
-			node* currentLine = lines[current_line];
-			node* nextLine = lines[current_line + 1];
+	enum Source { ORIGINAL, ADDED };
+	struct Piece {
+		Source source;
+		size_t start;
+		size_t length;
+		size_t lineFeeds;   // Number of '\n' inside this piece
+	};
+	// Replacement of `length` characters at `offset` by `text`
+	struct Splice {
+		size_t offset;
+		size_t length;
+		string text;
+	};
 
-			// Find the end of the current line
-			while (currentLine && currentLine->next) {
-				currentLine = currentLine->next;
-			}
+private:
+	struct PieceNode {
+		Piece piece;
+		PieceNode* left;
+		PieceNode* right;
+		unsigned priority;
+		size_t subtreeLength;       // Characters in this subtree
+		size_t subtreeLineFeeds;    // Line feeds in this subtree
+	};
 
-			// Link the last node of the current line to the first node of the next line
-			if (currentLine) {
-				currentLine->next = nextLine;
-				if (nextLine) {
-					nextLine->previous = currentLine;
-				}
-			}
+	FileBuffer original;
+	string added;
+	vector<size_t> originalLineFeeds;   // Offsets of every '\n' in original
+	vector<size_t> addedLineFeeds;      // Offsets of every '\n' in added
+	PieceNode* root;
+	NodePool<PieceNode> pool;
+	// Subtrees dropped by erase(); their nodes are reclaimed one at a time as
+	// new ones are needed, so releasing any amount of text is O(1).
+	vector<PieceNode*> freedSubtrees;
+	unsigned seed;
+	size_t editVersion;     // Bumped on every change so caches can tell they are stale
+	size_t loadedLength;    // Length of the document as loaded from `original`
 
-			// Remove the next line from the vector
-			lines.erase(lines.begin() + current_line + 1);
-			markModified();
-			updateStatus("Joined lines");
-		}
+	// The text last given to insertShared() and where it is in `added`
+	struct SharedSpan {
+		shared_ptr<const string> text;
+		Piece piece;
+	};
+	SharedSpan lastShared;
+
+	// Hashes of the loaded text by blocks: blockHashes[i] is the hash of its
+	// first i blocks. Filled by `hasher`, and read only once it is joined.
+	static constexpr size_t HASH_BLOCK = 16 << 10;
+	static constexpr size_t BACKGROUND_HASH_BYTES = 1 << 20;
+	mutable vector<uint64_t> blockHashes;
+	mutable thread hasher;
+	mutable atomic<bool> hashCancelled;
+	mutable bool hashStarted;
+
+	const char* bufferOf(Source source) const {
+		return source == ORIGINAL ? original.data() : added.data();
+	}
+	const vector<size_t>& lineFeedsOf(Source source) const {
+		return source == ORIGINAL ? originalLineFeeds : addedLineFeeds;
 	}
 
-	void indentLine(bool increase) {
-		node* currentLine = lines[current_line];
-		if (!currentLine) return;
+	// Puts `piece`, whose bytes are already in `added`, at `offset`
+	void insertAdded(size_t offset, const Piece& piece) {
+		offset = min(offset, length());
+		editVersion++;
+		PieceNode* left;
+		PieceNode* right;
+		split(root, offset, left, right);
+		size_t line = feedsIn(left);
 
-		// Indent or unindent by adding/removing spaces
-		if (increase) {
-			insert(' '); // Add a space at the beginning
+		// Typing usually continues right after the previous insertion, in
+		// which case the last piece before the offset simply grows.
+		if (!extendLastPiece(left, piece.start, piece.length, piece.lineFeeds)) {
+			left = merge(left, newNode(piece));
 		}
-		else {
-			// Remove the first character if it's a space
-			if (currentLine->data == ' ') {
-				deleteCharacterAtCursor(); // This will delete the first space
-			}
+		root = merge(left, right);
+		if (onLinesChanged) {
+			onLinesChanged(line, 0, piece.lineFeeds);
 		}
-		markModified();
-		updateStatus(increase ? "Indented line" : "Unindented line");
-	}
-
-	void deleteLineNumber(size_t lineNum) {
-		if (lineNum < 1 || lineNum > lines.size()) {
-			cout << "Invalid line number." << endl;
-			return;
+		if (onTextChanged) {
+			onTextChanged(offset, 0, added.data() + piece.start, piece.length);
 		}
+	}
 
-		// Adjust for 0-based index
-		lineNum--;
-
-		// Delete the specified line
-		node* currentLine = lines[lineNum];
-		while (currentLine) {
-			node* toDelete = currentLine;
-			currentLine = currentLine->next;
-			delete toDelete;
+	// Must be called before the loaded text goes away
+	void stopHashing() {
+		if (hasher.joinable()) {
+			hashCancelled = true;
+			hasher.join();
 		}
-
-		lines.erase(lines.begin() + lineNum);
-		if (current_line >= lines.size()) {
-			current_line = lines.size() - 1; // Adjust current line if needed
+		hashCancelled = false;
+		hashStarted = false;
+		vector<uint64_t>().swap(blockHashes);
+	}
+	void waitForHashes() const {
+		prepareHash();
+		if (hasher.joinable()) hasher.join();
+	}
+	// Hash of `length` loaded bytes from `start`: only the bytes outside
+	// whole blocks are read
+	uint64_t loadedHash(size_t start, size_t length) const {
+		size_t end = start + length;
+		size_t firstBlock = (start + HASH_BLOCK - 1) / HASH_BLOCK;
+		size_t lastBlock = end / HASH_BLOCK;
+		if (firstBlock >= lastBlock) {
+			return ContentHash::of(string_view(original.data() + start, length));
 		}
-		markModified();
-		updateStatus("Deleted line " + to_string(lineNum + 1));
+		ContentHash hash;
+		hash.add(original.data() + start, firstBlock * HASH_BLOCK - start);
+		size_t blocksLength = (lastBlock - firstBlock) * HASH_BLOCK;
+		hash.append(ContentHash::rest(blockHashes[lastBlock], blockHashes[firstBlock], blocksLength), blocksLength);
+		hash.add(original.data() + lastBlock * HASH_BLOCK, end - lastBlock * HASH_BLOCK);
+		return hash.finish();
 	}
-
-	void executeWithCount(int count, const string& cmd) {
-		if (cmd == "dd") {
-			for (int i = 0; i < count; ++i) {
-				deleteLineNumber(current_line + 1); // Delete the current line
+	static void collectLineFeeds(const char* data, size_t length, size_t base, vector<size_t>& out) {
+#if defined(__SSE2__) && defined(__GNUC__)
+		// Compare 16 bytes at a time and walk the bits of the match mask
+		const __m128i newline = _mm_set1_epi8('\n');
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16) {
+			__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+			while (mask) {
+				out.push_back(base + i + __builtin_ctz(mask));
+				mask &= mask - 1;
 			}
 		}
-		else if (cmd == "yy") {
-			// Implement yank (copy) functionality for count lines
-			// This is a placeholder; you would need to implement the actual yank logic
-			cout << "Yanked " << count << " lines." << endl;
+		data += i;
+		length -= i;
+		base += i;
+#endif
+		const char* p = data;
+		const char* end = data + length;
+		while (p < end) {
+			const char* hit = static_cast<const char*>(memchr(p, '\n', end - p));
+			if (!hit) break;
+			out.push_back(base + (hit - data));
+			p = hit + 1;
 		}
-		else if (cmd == "j") {
-			for (int i = 0; i < count; ++i) {
-				moveDown(); // Move down count lines
-			}
+	}
+	size_t countLineFeeds(Source source, size_t start, size_t length) const {
+		const vector<size_t>& feeds = lineFeedsOf(source);
+		return lower_bound(feeds.begin(), feeds.end(), start + length) - lower_bound(feeds.begin(), feeds.end(), start);
+	}
+	Piece makePiece(Source source, size_t start, size_t length) const {
+		return Piece{ source, start, length, countLineFeeds(source, start, length) };
+	}
+
+	void indexOriginal() {
+		const size_t BLOCK = 64 << 20;
+		for (size_t offset = 0; offset < original.size(); offset += BLOCK) {
+			size_t length = min(BLOCK, original.size() - offset);
+			collectLineFeeds(original.data() + offset, length, offset, originalLineFeeds);
+			// Scanning must not leave the whole file resident
+			original.dropPages(offset, length);
 		}
-		else if (cmd == ">>") {
-			for (int i = 0; i < count; ++i) {
-				indentLine(true); // Indent current line
-			}
+		size_t length = original.size();
+		if (length > 0 && original.data()[length - 1] == '\n') {
+			length--;
 		}
-		else if (cmd == "<<") {
-			for (int i = 0; i < count; ++i) {
-				indentLine(false); // Unindent current line
-			}
+		if (length > 0) {
+			root = newNode(makePiece(ORIGINAL, 0, length));
 		}
+		loadedLength = length;
 	}
-	void moveToColumn(size_t column) {
-		Cursor = lines[current_line];
-		for (size_t i = 0; i < column && Cursor != nullptr; ++i) {
-			Cursor = Cursor->next;
-		}
+	static size_t lengthOf(const PieceNode* n) {
+		return n ? n->subtreeLength : 0;
 	}
-	void search(const string& str) {
-		if (searchEngine.search(lines, str)) {
-			current_line = searchEngine.lastMatchLine;
-			moveToColumn(searchEngine.lastMatchColumn);
-			updateStatus("Search: " + str);
+	static size_t feedsIn(const PieceNode* n) {
+		return n ? n->subtreeLineFeeds : 0;
+	}
+	static void update(PieceNode* n) {
+		n->subtreeLength = lengthOf(n->left) + n->piece.length + lengthOf(n->right);
+		n->subtreeLineFeeds = feedsIn(n->left) + n->piece.lineFeeds + feedsIn(n->right);
+	}
+	PieceNode* newNode(const Piece& piece) {
+		// xorshift keeps the priorities cheap and the tree shape reproducible
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		PieceNode* n;
+		if (!freedSubtrees.empty()) {
+			n = freedSubtrees.back();
+			freedSubtrees.pop_back();
+			if (n->left) freedSubtrees.push_back(n->left);
+			if (n->right) freedSubtrees.push_back(n->right);
 		}
 		else {
-			cout << "Pattern not found: " << str << endl;
+			n = pool.allocate();
 		}
+		*n = PieceNode{ piece, nullptr, nullptr, seed, 0, 0 };
+		update(n);
+		return n;
 	}
-
-	void findNext() {
-		if (searchEngine.findNext(lines)) {
-			current_line = searchEngine.lastMatchLine;
-			moveToColumn(searchEngine.lastMatchColumn);
-			updateStatus("Find Next");
+	void freeTree(PieceNode* n) {
+		if (n) freedSubtrees.push_back(n);
+	}
+	// Grows the last piece of `n` when it ends exactly where the add buffer
+	// continues, fixing up the subtree totals on the way back.
+	static bool extendLastPiece(PieceNode* n, size_t addStart, size_t count, size_t feeds) {
+		if (!n) return false;
+		if (n->right) {
+			if (!extendLastPiece(n->right, addStart, count, feeds)) return false;
 		}
 		else {
-			cout << "No more occurrences found." << endl;
+			Piece& last = n->piece;
+			if (last.source != ADDED || last.start + last.length != addStart) return false;
+			last.length += count;
+			last.lineFeeds += feeds;
 		}
+		update(n);
+		return true;
 	}
-
-
-	void findPrevious() {
-		if (searchEngine.findPrevious(lines)) {
-			current_line = searchEngine.lastMatchLine;
-			moveToColumn(searchEngine.lastMatchColumn);
-			updateStatus("Find Previous");
-		}
-		else {
-			cout << "No previous occurrences found." << endl;
+	static PieceNode* merge(PieceNode* a, PieceNode* b) {
+		if (!a) return b;
+		if (!b) return a;
+		if (a->priority > b->priority) {
+			a->right = merge(a->right, b);
+			update(a);
+			return a;
 		}
+		b->left = merge(a, b->left);
+		update(b);
+		return b;
 	}
-
-	void replace(const string& oldStr, const string& newStr, bool global) {
-		if (searchEngine.replace(lines, oldStr, newStr, global)) {
-			updateStatus("Replaced: " + oldStr + " with " + newStr);
+	// Splits `n` so that `left` holds the first `offset` characters, cutting a
+	// piece in two when the offset falls inside it.
+	void split(PieceNode* n, size_t offset, PieceNode*& left, PieceNode*& right) {
+		if (!n) {
+			left = right = nullptr;
+			return;
+		}
+		size_t leftLength = lengthOf(n->left);
+		if (offset <= leftLength) {
+			split(n->left, offset, left, n->left);
+			update(n);
+			right = n;
+		}
+		else if (offset >= leftLength + n->piece.length) {
+			split(n->right, offset - leftLength - n->piece.length, n->right, right);
+			update(n);
+			left = n;
 		}
 		else {
-			cout << "No occurrences of " << oldStr << " found in the current line." << endl;
+			size_t inner = offset - leftLength;
+			const Piece& piece = n->piece;
+			PieceNode* tail = newNode(makePiece(piece.source, piece.start + inner, piece.length - inner));
+			n->piece = makePiece(piece.source, piece.start, inner);
+			right = merge(tail, n->right);
+			n->right = nullptr;
+			update(n);
+			left = n;
 		}
 	}
-	void replaceFirst(const string& oldText, const string& newText) {
-		if (oldText.empty()) {
-			updateStatus("Error: Search text cannot be empty.");
-			return;
+	// Builds a treap over `pieces` in order in linear time, keeping the
+	// right spine on a stack as priorities are drawn.
+	PieceNode* build(const vector<Piece>& pieces) {
+		vector<PieceNode*> spine;
+		for (const Piece& piece : pieces) {
+			PieceNode* n = newNode(piece);
+			PieceNode* below = nullptr;
+			while (!spine.empty() && spine.back()->priority < n->priority) {
+				below = spine.back();
+				spine.pop_back();
+			}
+			n->left = below;
+			if (!spine.empty()) spine.back()->right = n;
+			spine.push_back(n);
 		}
-
-		node* current = lines[current_line];
-		size_t matchIndex = 0;
-		node* matchStart = nullptr;
-
-		// Traverse the linked list to find the first match
-		while (current) {
-			if (current->data == oldText[matchIndex]) {
-				if (matchIndex == 0) matchStart = current;
-				matchIndex++;
-
-				if (matchIndex == oldText.length()) {
-					// Match found; perform the replacement
-					node* replaceCursor = matchStart;
-					for (char ch : newText) {
-						replaceCursor->data = ch;
-						if (replaceCursor->next == nullptr && &ch != &newText.back()) {
-							// Add new nodes if newText is longer than oldText
-							node* newNode = new node('\0');
-							replaceCursor->next = newNode;
-							newNode->previous = replaceCursor;
-						}
-						replaceCursor = replaceCursor->next;
-					}
-
-					// Remove extra nodes if newText is shorter
-					while (replaceCursor && matchIndex < oldText.length()) {
-						node* toDelete = replaceCursor;
-						replaceCursor = replaceCursor->next;
-						delete toDelete;
-						matchIndex++;
-					}
-
-					if (replaceCursor) replaceCursor->previous = matchStart;
-					matchStart->next = replaceCursor;
-
-					markModified();
-					updateStatus("First occurrence replaced.");
-					return;
-				}
+		PieceNode* top = spine.empty() ? nullptr : spine.front();
+		updateAll(top);
+		return top;
+	}
+	static void updateAll(PieceNode* n) {
+		if (!n) return;
+		updateAll(n->left);
+		updateAll(n->right);
+		update(n);
+	}
+	// Node holding the character at `offset` (nullptr at the end of text);
+	// `inner` receives the offset relative to its piece.
+	const PieceNode* findPiece(size_t offset, size_t& inner) const {
+		const PieceNode* n = root;
+		while (n) {
+			size_t leftLength = lengthOf(n->left);
+			if (offset < leftLength) {
+				n = n->left;
+			}
+			else if (offset < leftLength + n->piece.length) {
+				inner = offset - leftLength;
+				return n;
 			}
 			else {
-				matchIndex = 0;
-				matchStart = nullptr;
+				offset -= leftLength + n->piece.length;
+				n = n->right;
 			}
-			current = current->next;
 		}
-
-		updateStatus("No occurrences found to replace.");
+		inner = 0;
+		return nullptr;
 	}
-
-	void replaceAll(const string& oldText, const string& newText) {
-		if (oldText.empty()) {
-			updateStatus("Error: Search text cannot be empty.");
-			return;
-		}
-
-		node* current = lines[current_line];
-		size_t matchIndex = 0;
-		node* matchStart = nullptr;
-		bool found = false;
-
-		// Traverse the linked list to find all matches
-		while (current) {
-			if (current->data == oldText[matchIndex]) {
-				if (matchIndex == 0) matchStart = current;
-				matchIndex++;
-
-				if (matchIndex == oldText.length()) {
-					// Match found; perform the replacement
-					node* replaceCursor = matchStart;
-					for (char ch : newText) {
-						replaceCursor->data = ch;
-						if (replaceCursor->next == nullptr && &ch != &newText.back()) {
-							// Add new nodes if newText is longer than oldText
-							node* newNode = new node('\0');
-							replaceCursor->next = newNode;
-							newNode->previous = replaceCursor;
-						}
-						replaceCursor = replaceCursor->next;
-					}
-
-					// Remove extra nodes if newText is shorter
-					while (replaceCursor && matchIndex < oldText.length()) {
-						node* toDelete = replaceCursor;
-						replaceCursor = replaceCursor->next;
-						delete toDelete;
-						matchIndex++;
-					}
-
-					if (replaceCursor) replaceCursor->previous = matchStart;
-					matchStart->next = replaceCursor;
-
-					found = true;
-					matchIndex = 0;
-					matchStart = nullptr; // Reset for the next match
-				}
+	// Calls f(piece, from, to) for the part [from, to) of every piece that
+	// overlaps [first, last) of the subtree starting at document offset `base`.
+	// f returns false to stop the walk, in which case visit() returns false.
+	template <typename F>
+	static bool visit(const PieceNode* n, size_t base, size_t first, size_t last, F& f) {
+		while (n && first < last) {
+			size_t pieceStart = base + lengthOf(n->left);
+			size_t pieceEnd = pieceStart + n->piece.length;
+			if (first < pieceStart && !visit(n->left, base, first, last, f)) {
+				return false;
 			}
-			else {
-				matchIndex = 0;
-				matchStart = nullptr;
+			if (first < pieceEnd && last > pieceStart) {
+				if (!f(n->piece, max(first, pieceStart) - pieceStart, min(last, pieceEnd) - pieceStart)) {
+					return false;
+				}
 			}
-			current = current->next;
+			if (last <= pieceEnd) return true;
+			base = pieceEnd;
+			n = n->right;
 		}
-
-		updateStatus(found ? "All occurrences replaced." : "No occurrences found to replace.");
-		if (found) markModified();
+		return true;
 	}
 
+public:
+	// Called after every edit with the line it started on and how many line
+	// feeds it removed and added, for indexes that follow the line structure.
+	function<void(size_t line, size_t removedLineFeeds, size_t addedLineFeeds)> onLinesChanged;
+	// Called after every edit with the characters removed at `offset` and the
+	// ones put in their place, for logs that must be able to replay it.
+	function<void(size_t offset, size_t removed, const char* inserted, size_t count)> onTextChanged;
 
-	void saveToFile(const string& filename) {
-		if (fileManager.saveFile(filename, lines)) {
-			cout << "File saved successfully to " << filename << "\n";
-		}
-		else {
-			cout << "Failed to save file!\n";
-		}
+	PieceTable() : root(nullptr), seed(2463534242u), editVersion(0), loadedLength(0), hashCancelled(false), hashStarted(false) {}
+	PieceTable(const PieceTable&) = delete;
+	PieceTable& operator=(const PieceTable&) = delete;
+	~PieceTable() {
+		stopHashing();
 	}
 
-	void loadFromFile(const string& filename) {
-		if (fileManager.loadFile(filename, lines)) {
-			current_line = 0;
-			Cursor = lines.empty() ? nullptr : lines[0];
-			updateStatus("File Loaded");
-		}
-		else {
-			cout << "Failed to load file!\n";
-		}
+	void clear() {
+		stopHashing();
+		original.release();
+		string().swap(added);
+		lastShared = SharedSpan();
+		vector<size_t>().swap(originalLineFeeds);
+		vector<size_t>().swap(addedLineFeeds);
+		// Every piece goes back to the pool in one step
+		root = nullptr;
+		editVersion++;
+		loadedLength = 0;
+		freedSubtrees.clear();
+		pool.releaseAll();
 	}
 
-	void markModified() {
-		fileManager.markAsModified();
+	// Takes ownership of the file contents; a final '\n' terminates the last
+	// line instead of starting a new one, as with getline().
+	void load(string&& content) {
+		clear();
+		original.assign(move(content));
+		indexOriginal();
 	}
 
-	bool hasUnsavedChanges() {
-		return fileManager.hasUnsavedChanges();
+	// Maps the file instead of reading it; only the line-feed index is built
+	// up front. Returns false when the file cannot be mapped.
+	bool loadMapped(const string& filename) {
+		clear();
+		if (!original.map(filename)) {
+			return false;
+		}
+		indexOriginal();
+		return true;
 	}
 
-	string getFileName() {
-		return fileManager.getCurrentFileName();
+	// Descriptor of the mapped file, or -1 when the text was read into memory
+	int originalFd() const {
+		return original.fd();
 	}
-	size_t countCharactersInLine(node* lineStart) {
-		size_t count = 0;
-		node* temp = lineStart;
-		while (temp != nullptr) {
-			count++;
-			temp = temp->next;
-		}
-		return count;
+	// Stops the text depending on the mapped file, before that file is
+	// overwritten in place. False when memory for the copy ran out.
+	bool keepOriginalPrivate() {
+		return original.keepPrivate();
 	}
-	void insert(char ch) {
-		node* new_node = new node(ch);
 
-		if (lines[current_line] == nullptr) {
-			lines[current_line] = new_node;
-			Cursor = new_node;
-		}
-		else if (Cursor == nullptr) {
-			new_node->next = lines[current_line];
-			lines[current_line]->previous = new_node;
-			lines[current_line] = new_node;
-			Cursor = new_node;
-		}
-		else {
-			new_node->next = Cursor->next;
-			new_node->previous = Cursor;
-			if (Cursor->next != nullptr) {
-				Cursor->next->previous = new_node;
+	size_t length() const {
+		return lengthOf(root);
+	}
+	size_t version() const {
+		return editVersion;
+	}
+	// The document as it was loaded. It stays untouched by edits until the
+	// next load or clear, so other threads may read it meanwhile.
+	string_view loadedText() const {
+		return string_view(original.data(), loadedLength);
+	}
+	size_t lineCount() const {
+		return feedsIn(root) + 1;
+	}
+	// Bytes held for this document: text buffers, line-feed indexes and nodes.
+	size_t memoryUsage() const {
+		return original.heapBytes() + added.capacity()
+			+ (originalLineFeeds.capacity() + addedLineFeeds.capacity()) * sizeof(size_t)
+			+ pool.bytesReserved();
+	}
+	// Gives back the spare capacity of the growing buffers
+	void compact() {
+		added.shrink_to_fit();
+		addedLineFeeds.shrink_to_fit();
+	}
+
+	// Offset of the first character of `line` (0-based).
+	size_t lineStart(size_t line) const {
+		if (line == 0) return 0;
+		if (line > feedsIn(root)) return length();
+		const PieceNode* n = root;
+		size_t pos = 0;
+		while (n) {
+			size_t leftFeeds = feedsIn(n->left);
+			if (line <= leftFeeds) {
+				n = n->left;
+				continue;
+			}
+			line -= leftFeeds;
+			pos += lengthOf(n->left);
+			if (line <= n->piece.lineFeeds) {
+				const vector<size_t>& feeds = lineFeedsOf(n->piece.source);
+				size_t first = lower_bound(feeds.begin(), feeds.end(), n->piece.start) - feeds.begin();
+				size_t feed = feeds[first + line - 1];
+				return pos + (feed - n->piece.start) + 1;
 			}
-			Cursor->next = new_node;
-			Cursor = new_node;
+			line -= n->piece.lineFeeds;
+			pos += n->piece.length;
+			n = n->right;
 		}
-		if (countCharactersInLine(lines[current_line]) > 30) {
-			auto tempCursor = Cursor;
-			Cursor = nullptr;
-			newLine();
-			Cursor = lines[current_line];
-			while (tempCursor != nullptr && tempCursor->next != nullptr) {
-				insert(tempCursor->next->data);
-				auto toDelete = tempCursor->next;
-				tempCursor->next = tempCursor->next->next;
-				if (tempCursor->next) {
-					tempCursor->next->previous = tempCursor;
-				}
-				delete toDelete;
+		return length();
+	}
+	// Offset just past the last character of `line` (its '\n' or end of text).
+	size_t lineEnd(size_t line) const {
+		return line + 1 < lineCount() ? lineStart(line + 1) - 1 : length();
+	}
+	size_t lineLength(size_t line) const {
+		return lineEnd(line) - lineStart(line);
+	}
+	// Line containing the character at `offset`.
+	size_t lineOf(size_t offset) const {
+		const PieceNode* n = root;
+		size_t feedsBefore = 0;
+		while (n) {
+			size_t leftLength = lengthOf(n->left);
+			if (offset < leftLength) {
+				n = n->left;
+				continue;
+			}
+			offset -= leftLength;
+			feedsBefore += feedsIn(n->left);
+			if (offset < n->piece.length) {
+				return feedsBefore + countLineFeeds(n->piece.source, n->piece.start, offset);
 			}
+			offset -= n->piece.length;
+			feedsBefore += n->piece.lineFeeds;
+			n = n->right;
 		}
-		markModified();
-		updateStatus("Insert");
+		return feedsIn(root);
 	}
 
+	char charAt(size_t offset) const {
+		size_t inner;
+		const PieceNode* n = findPiece(offset, inner);
+		if (!n) return '\0';
+		return bufferOf(n->piece.source)[n->piece.start + inner];
+	}
 
-	void moveUp() {
-		if (current_line > 0) {
-			current_line--;
-			Cursor = lines[current_line];
-		}
+	string substr(size_t offset, size_t count) const {
+		string result;
+		if (offset >= length()) return result;
+		count = min(count, length() - offset);
+		result.reserve(count);
+		auto append = [&](const Piece& piece, size_t from, size_t to) {
+			result.append(bufferOf(piece.source) + piece.start + from, to - from);
+			return true;
+			};
+		visit(root, 0, offset, offset + count, append);
+		return result;
 	}
 
-	void moveDown() {
-		if (current_line < lines.size() - 1) {
-			current_line++;
-			Cursor = lines[current_line];
-		}
+	string getLine(size_t line) const {
+		size_t start = lineStart(line);
+		return substr(start, lineEnd(line) - start);
 	}
 
-	void moveRight() {
-		if (Cursor != nullptr) {
-			Iterator it(Cursor);
-			++it;
-			Cursor = it.getNode();
+	// Contiguous view of a line: points straight into the piece buffers when the
+	// line lies inside one piece, otherwise it is assembled in `scratch`.
+	string_view lineView(size_t line, string& scratch) const {
+		size_t start = lineStart(line);
+		size_t count = lineEnd(line) - start;
+		if (count == 0) return string_view();
+		size_t inner;
+		const PieceNode* n = findPiece(start, inner);
+		if (inner + count <= n->piece.length) {
+			return string_view(bufferOf(n->piece.source) + n->piece.start + inner, count);
 		}
+		scratch = substr(start, count);
+		return string_view(scratch);
 	}
 
-	void moveLeft() {
-		if (Cursor != nullptr) {
-			Iterator it(Cursor);
-			--it;
-			Cursor = it.getNode();
+	// Starts hashing the loaded text by blocks, in the background when it is
+	// large, so that hash() does not have to read it all
+	void prepareHash() const {
+		if (hashStarted) return;
+		hashStarted = true;
+		string_view loaded = loadedText();
+		auto hashBlocks = [this, loaded]() {
+			vector<uint64_t> hashes(1, 0);
+			ContentHash hash;
+			for (size_t at = 0; at + HASH_BLOCK <= loaded.size() && !hashCancelled; at += HASH_BLOCK) {
+				hash.add(loaded.data() + at, HASH_BLOCK);
+				hashes.push_back(hash.finish());
+			}
+			blockHashes = move(hashes);
+			};
+		if (loaded.size() < BACKGROUND_HASH_BYTES) {
+			hashBlocks();
+		}
+		else {
+			hasher = thread(hashBlocks);
 		}
 	}
+	// ContentHash of the document. Once the loaded text is hashed by blocks,
+	// this reads the bytes added by edits and, of the loaded ones, only those
+	// at the edges of pieces.
+	uint64_t hash() const {
+		waitForHashes();
+		ContentHash hash;
+		forEachPiece([&](const Piece& piece, const char* data) {
+			if (piece.source == ORIGINAL) {
+				hash.append(loadedHash(piece.start, piece.length), piece.length);
+			}
+			else {
+				hash.add(data, piece.length);
+			}
+			});
+		return hash.finish();
+	}
+	// ContentHash of loadedText()
+	uint64_t loadedHash() const {
+		waitForHashes();
+		return loadedHash(0, loadedLength);
+	}
 
-	void newLine() {
-		lines.insert(lines.begin() + current_line + 1, nullptr);
-		current_line++;
-		Cursor = nullptr;
+	// Calls f(const Piece&, const char* text) for every piece in order.
+	template <typename F>
+	void forEachPiece(F f) const {
+		auto emit = [&](const Piece& piece, size_t, size_t) {
+			f(piece, bufferOf(piece.source) + piece.start);
+			return true;
+			};
+		visit(root, 0, 0, length(), emit);
 	}
 
-	void enterInsertMode() {
-		insertMode = true;
+	// Calls f(const char*, size_t) for every contiguous span of text in order.
+	template <typename F>
+	void forEachSpan(F f) const {
+		auto emit = [&](const Piece& piece, size_t from, size_t to) {
+			f(bufferOf(piece.source) + piece.start + from, to - from);
+			return true;
+			};
+		visit(root, 0, 0, length(), emit);
 	}
 
-	void exitInsertMode() {
-		insertMode = false;
+	// First match of `finder` starting in [from, to), scanning each piece in
+	// place; matches that straddle two pieces are checked on a small window
+	// around the seam. Returns string::npos when there is none.
+	template <typename Finder>
+	size_t find(const Finder& finder, size_t from, size_t to = string::npos) const {
+		size_t patternLength = finder.size();
+		if (patternLength == 0 || from + patternLength > length() || from >= to) return string::npos;
+		size_t last = to - from < length() - from ? min(length(), to + patternLength - 1) : length();
+		size_t found = string::npos;
+		size_t spanStart = from;
+		string tail;    // Last patternLength - 1 bytes before the current span
+		auto scan = [&](const Piece& piece, size_t begin, size_t end) {
+			const char* data = bufferOf(piece.source) + piece.start + begin;
+			size_t count = end - begin;
+			if (!tail.empty()) {
+				string window = tail;
+				window.append(data, min(count, patternLength - 1));
+				size_t hit = finder.find(window.data(), window.size(), 0);
+				if (hit != string::npos && hit < tail.size()) {
+					found = spanStart - tail.size() + hit;
+					return false;
+				}
+			}
+			size_t hit = finder.find(data, count, 0);
+			if (hit != string::npos) {
+				found = spanStart + hit;
+				return false;
+			}
+			tail.append(data + count - min(count, patternLength - 1), min(count, patternLength - 1));
+			if (tail.size() > patternLength - 1) {
+				tail.erase(0, tail.size() - (patternLength - 1));
+			}
+			spanStart += count;
+			return true;
+			};
+		visit(root, 0, from, last, scan);
+		return found;
 	}
 
-	bool isInsertMode() const {
-		return insertMode;
+	void insert(size_t offset, const char* text, size_t count) {
+		if (count == 0) return;
+		size_t addStart = added.size();
+		added.append(text, count);
+		size_t feedsBefore = addedLineFeeds.size();
+		collectLineFeeds(text, count, addStart, addedLineFeeds);
+		insertAdded(offset, Piece{ ADDED, addStart, count, addedLineFeeds.size() - feedsBefore });
+	}
+	void insert(size_t offset, const string& text) {
+		insert(offset, text.data(), text.size());
 	}
-	/*void deleteCurrentLine() {
-		if (lines[current_line] == nullptr) {
+	// Inserts text that is kept elsewhere too, such as in a register, and
+	// may be inserted again. It is appended to `added` only the first time
+	// in a row; the next insertions of the same string are pieces over the
+	// bytes appended then.
+	void insertShared(size_t offset, const shared_ptr<const string>& text) {
+		if (text->empty()) return;
+		if (text != lastShared.text) {
+			size_t addStart = added.size();
+			insert(offset, *text);
+			lastShared = SharedSpan{ text, makePiece(ADDED, addStart, text->size()) };
 			return;
 		}
-		node* temp = lines[current_line];
-		while (temp != nullptr) {
-			node* to_delete = temp;
-			temp = temp->next;
-			delete to_delete;
+		insertAdded(offset, lastShared.piece);
+	}
+
+	// Applies non-overlapping splices given in document order. A few are
+	// applied one at a time; many are merged into the piece sequence in one
+	// pass and the tree is rebuilt, which is linear instead of a split and a
+	// merge per splice.
+	void splice(const vector<Splice>& splices) {
+		const size_t REBUILD_SPLICES = 256;
+		if (splices.size() < REBUILD_SPLICES) {
+			for (size_t i = splices.size(); i-- > 0;) {
+				erase(splices[i].offset, splices[i].length);
+				insert(splices[i].offset, splices[i].text);
+			}
+			return;
 		}
-		lines[current_line] = nullptr;
-		if (current_line > 0) {
-			current_line--;
+
+		vector<Piece> pieces;
+		forEachPiece([&](const Piece& piece, const char*) {
+			pieces.push_back(piece);
+			});
+		vector<Piece> result;
+		result.reserve(pieces.size() + 2 * splices.size());
+		auto append = [&](const Piece& piece) {
+			if (!result.empty()) {
+				Piece& previous = result.back();
+				if (previous.source == piece.source && previous.start + previous.length == piece.start) {
+					previous.length += piece.length;
+					previous.lineFeeds += piece.lineFeeds;
+					return;
+				}
+			}
+			result.push_back(piece);
+			};
+		size_t next = 0;        // Piece being consumed
+		size_t inner = 0;       // Characters of it already consumed
+		size_t position = 0;    // Document offset reached
+		// Consumes `count` characters, keeping them when `keep`, and adds
+		// their line feeds to `feeds`
+		auto advance = [&](size_t count, bool keep, size_t& feeds) {
+			while (count > 0 && next < pieces.size()) {
+				const Piece& piece = pieces[next];
+				size_t take = min(count, piece.length - inner);
+				Piece part = take == piece.length ? piece : makePiece(piece.source, piece.start + inner, take);
+				if (keep) append(part);
+				feeds += part.lineFeeds;
+				inner += take;
+				position += take;
+				count -= take;
+				if (inner == piece.length) {
+					next++;
+					inner = 0;
+				}
+			}
+			};
+
+		struct Change {
+			size_t line;
+			size_t removedFeeds;
+			size_t addedFeeds;
+		};
+		vector<Change> changes;
+		changes.reserve(splices.size());
+		size_t feeds = 0;       // Line feeds before `position` in the old text
+		for (const Splice& edit : splices) {
+			advance(edit.offset > position ? edit.offset - position : 0, true, feeds);
+			size_t line = feeds;
+			advance(edit.length, false, feeds);
+			size_t addStart = added.size();
+			added += edit.text;
+			size_t feedsBefore = addedLineFeeds.size();
+			collectLineFeeds(edit.text.data(), edit.text.size(), addStart, addedLineFeeds);
+			size_t newFeeds = addedLineFeeds.size() - feedsBefore;
+			if (!edit.text.empty()) {
+				append(Piece{ ADDED, addStart, edit.text.size(), newFeeds });
+			}
+			changes.push_back(Change{ line, feeds - line, newFeeds });
 		}
-		else if (current_line < lines.size() - 1) {
-			current_line++;
+		advance(length() - position, true, feeds);
+
+		editVersion++;
+		freeTree(root);
+		root = build(result);
+		// Reported last to first, as if applied one at a time from the end
+		if (onLinesChanged) {
+			for (size_t i = changes.size(); i-- > 0;) {
+				onLinesChanged(changes[i].line, changes[i].removedFeeds, changes[i].addedFeeds);
+			}
+		}
+		if (onTextChanged) {
+			for (size_t i = splices.size(); i-- > 0;) {
+				onTextChanged(splices[i].offset, splices[i].length, splices[i].text.data(), splices[i].text.size());
+			}
 		}
+	}
 
-		Cursor = lines[current_line];
-	}*/
-	void deleteToEndOfLine() {
-		if (lines[current_line] == nullptr || Cursor == nullptr) {
-			return;
+	void erase(size_t offset, size_t count) {
+		if (offset >= length() || count == 0) return;
+		editVersion++;
+		PieceNode* left;
+		PieceNode* middle;
+		PieceNode* right;
+		split(root, offset, left, middle);
+		split(middle, count, middle, right);
+		size_t line = feedsIn(left);
+		size_t removedFeeds = feedsIn(middle);
+		size_t removed = lengthOf(middle);
+		freeTree(middle);
+		root = merge(left, right);
+		if (onLinesChanged) {
+			onLinesChanged(line, removedFeeds, 0);
 		}
-		node* temp = Cursor;
-		while (temp != nullptr) {
-			node* toDelete = temp;
-			temp = temp->next;
-			delete toDelete;
+		if (onTextChanged) {
+			onTextChanged(offset, removed, nullptr, 0);
 		}
-		Cursor->next = nullptr;
-		Cursor = nullptr;
 	}
-	void deleteCharacterAtCursor() {
-		node* temp = Cursor;
+};
 
-		if (lines[current_line] == nullptr || Cursor == nullptr) {
-			return;
+// Fixed set of worker threads shared by everything that splits work into
+// independent chunks. parallelFor() lets the calling thread take part, so it
+// also makes progress when every worker is busy.
+class ThreadPool {
+	vector<thread> workers;
+	deque<function<void()>> tasks;
+	mutex lock;
+	condition_variable wake;
+	bool stopping;
+
+	void work() {
+		while (true) {
+			function<void()> task;
+			{
+				unique_lock<mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) return;
+				task = move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
 		}
-		/*if (temp->previous == nullptr && temp->next == nullptr) {
-			deleteCurrentLine();
-		}*/
-		else  if (temp->previous == nullptr) {
-			lines[current_line] = temp->next;
-			lines[current_line]->previous = nullptr;
-			Cursor = lines[current_line];
+	}
+
+public:
+	explicit ThreadPool(size_t threads) : stopping(false) {
+		for (size_t i = 0; i < threads; ++i) {
+			workers.emplace_back([this] { work(); });
 		}
-		else if (temp->next == nullptr) {
-			temp->previous->next = nullptr;
-			Cursor = temp->previous;
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
 		}
-		else {
-			temp->previous->next = temp->next;
-			temp->next->previous = temp->previous;
-			Cursor = temp->next;
+		wake.notify_all();
+		for (thread& worker : workers) {
+			worker.join();
 		}
-		delete temp;
-		markModified();
 	}
-	void backspace() {
-		node* temp = Cursor->previous;
 
-		if (lines[current_line] == nullptr || Cursor == nullptr || Cursor->previous == nullptr) {
-			return;
+	size_t size() const {
+		return workers.size();
+	}
+
+	void submit(function<void()> task) {
+		{
+			lock_guard<mutex> guard(lock);
+			tasks.push_back(move(task));
 		}
+		wake.notify_one();
+	}
 
-		/*if (temp->previous == nullptr) {
-			yankLine();
-			deleteCurrentLine();
-			moveToEndOfLine();
-			for (auto ch : copyBuffer) {
-				insert(ch);
+	// Runs body(i) for every i in [0, count) and returns when all are done.
+	void parallelFor(size_t count, const function<void(size_t)>& body) {
+		if (count == 0) return;
+		struct Progress {
+			atomic<size_t> next;
+			size_t finished;
+			mutex lock;
+			condition_variable allDone;
+		};
+		// Helpers may start after we return, so they share the state by pointer
+		shared_ptr<Progress> progress = make_shared<Progress>();
+		progress->next = 0;
+		progress->finished = 0;
+		auto run = [progress, count, &body]() {
+			size_t done = 0;
+			for (size_t i; (i = progress->next++) < count; ++done) {
+				body(i);
 			}
-		}*/
-		else {
-			temp->previous->next = Cursor;
-			Cursor->previous = temp->previous;
+			if (done > 0) {
+				lock_guard<mutex> guard(progress->lock);
+				progress->finished += done;
+				if (progress->finished == count) progress->allDone.notify_all();
+			}
+			};
+		for (size_t i = 1; i < min(count, workers.size() + 1); ++i) {
+			// Once every index is claimed a late helper touches nothing but
+			// `progress`, so the dangling `body` reference is never used
+			submit(run);
 		}
-		delete temp;
+		run();
+		unique_lock<mutex> guard(progress->lock);
+		progress->allDone.wait(guard, [&] { return progress->finished == count; });
 	}
-	void yankLine() {
-		if (!lines[current_line]) {
-			return;
+
+	static ThreadPool& shared() {
+		static ThreadPool pool(max(1u, thread::hardware_concurrency()));
+		return pool;
+	}
+};
+
+// Substring finder compiled once per pattern. Short patterns are located
+// with a SIMD filter on the first and last pattern byte (AVX2 when the CPU
+// has it, SSE2 otherwise, plain loops elsewhere) so only the few candidates
+// that pass are compared; long patterns use Boyer-Moore-Horspool, whose
+// skips grow with the pattern length.
+class Finder {
+	string pattern;
+	size_t shift[256];
+	bool useAvx2;
+
+	size_t findScalar(const char* text, size_t length, size_t from) const {
+		size_t m = pattern.size();
+		const char* p = text + from;
+		const char* end = text + length - m + 1;
+		while (p < end) {
+			p = static_cast<const char*>(memchr(p, pattern[0], end - p));
+			if (!p) break;
+			if (memcmp(p + 1, pattern.data() + 1, m - 1) == 0) return p - text;
+			p++;
 		}
-		copyBuffer.clear();
-		auto temp = lines[current_line];
-		while (temp->next != nullptr) {
-			copyBuffer.push_back(temp->data);
-			temp = temp->next;
+		return string::npos;
+	}
+
+	size_t findHorspool(const char* text, size_t length, size_t from) const {
+		size_t m = pattern.size();
+		unsigned char last = pattern[m - 1];
+		for (size_t i = from; i + m <= length;) {
+			unsigned char c = text[i + m - 1];
+			if (c == last && memcmp(text + i, pattern.data(), m - 1) == 0) return i;
+			i += shift[c];
 		}
+		return string::npos;
 	}
-	void pasteAfter() {
-		if (copyBuffer.empty()) {
-			return;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	size_t findSse2(const char* text, size_t length, size_t from) const {
+		size_t m = pattern.size();
+		const __m128i first = _mm_set1_epi8(pattern[0]);
+		const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+		size_t i = from;
+		for (; i + m - 1 + 16 <= length; i += 16) {
+			__m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+			__m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + m - 1));
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast)));
+			while (mask) {
+				size_t pos = i + __builtin_ctz(mask);
+				if (memcmp(text + pos + 1, pattern.data() + 1, m - 2) == 0) return pos;
+				mask &= mask - 1;
+			}
 		}
-		newLine();
-		for (char ch : copyBuffer) {
-			insert(ch);
+		return findScalar(text, length, i);
+	}
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+	__attribute__((target("avx2")))
+	size_t findAvx2(const char* text, size_t length, size_t from) const {
+		size_t m = pattern.size();
+		const __m256i first = _mm256_set1_epi8(pattern[0]);
+		const __m256i last = _mm256_set1_epi8(pattern[m - 1]);
+		size_t i = from;
+		for (; i + m - 1 + 32 <= length; i += 32) {
+			__m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+			__m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + m - 1));
+			unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+			while (mask) {
+				size_t pos = i + __builtin_ctz(mask);
+				if (memcmp(text + pos + 1, pattern.data() + 1, m - 2) == 0) return pos;
+				mask &= mask - 1;
+			}
 		}
+		return findScalar(text, length, i);
 	}
-	void pasteBefore() {
-		if (current_line > 0) {
-			current_line--;
-			Cursor = lines[current_line];
-			newLine();
-			for (char ch : copyBuffer) {
-				insert(ch);
+#endif
+
+public:
+	// Patterns at least this long are searched with Horspool
+	static constexpr size_t LONG_PATTERN = 32;
+
+	explicit Finder(const string& pattern) : pattern(pattern), useAvx2(false) {
+		size_t m = pattern.size();
+		for (size_t& s : shift) {
+			s = max<size_t>(m, 1);
+		}
+		for (size_t j = 0; j + 1 < m; ++j) {
+			shift[static_cast<unsigned char>(pattern[j])] = m - 1 - j;
+		}
+#if defined(__GNUC__) && defined(__x86_64__)
+		useAvx2 = __builtin_cpu_supports("avx2");
+#endif
+	}
+
+	size_t size() const {
+		return pattern.size();
+	}
+
+	// Position of the first match in text[from, length), or string::npos.
+	size_t find(const char* text, size_t length, size_t from = 0) const {
+		size_t m = pattern.size();
+		if (m == 0) return from <= length ? from : string::npos;
+		if (from > length || length - from < m) return string::npos;
+		if (m == 1) {
+			const void* hit = memchr(text + from, pattern[0], length - from);
+			return hit ? static_cast<const char*>(hit) - text : string::npos;
+		}
+		if (m >= LONG_PATTERN) return findHorspool(text, length, from);
+#if defined(__GNUC__) && defined(__x86_64__)
+		if (useAvx2) return findAvx2(text, length, from);
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+		return findSse2(text, length, from);
+#else
+		return findScalar(text, length, from);
+#endif
+	}
+	size_t find(string_view text, size_t from = 0) const {
+		return find(text.data(), text.size(), from);
+	}
+};
+
+// Regular expressions for / and :s in Vim's "magic" syntax:
+//   .  [abc]  [^a-z]  *  \+  \?  \=  \{n,m}  \{-n,m}  \(...\)  \|  ^  $
+//   \d \w \s \D \W \S \t and \. \* \[ etc. for the literal characters
+// A leading \v switches to "very magic", where ( ) | + ? = { need no
+// backslash. Patterns compile to a Thompson NFA. A Matcher first runs a line
+// through a lazily built DFA, which only answers whether the line matches;
+// lines that do are run through a Pike VM for the leftmost match and its
+// groups. Both are linear in the line length, so no pattern can hang the
+// editor; back-references would need backtracking and are rejected.
+// Patterns without any operator are searched with a Finder instead.
+class Regex {
+public:
+	static constexpr size_t MAX_GROUPS = 10;        // \0 (whole match) to \9
+	static constexpr size_t MAX_PROGRAM = 20000;    // Instructions after expanding \{n,m}
+
+private:
+	enum Op { CHAR, CLASS, ANY, SPLIT, JMP, SAVE, BOL, EOL, MATCH };
+	struct Inst {
+		Op op;
+		unsigned char c;
+		int x;      // Jump target, SAVE slot or class index
+		int y;      // Second SPLIT target (lower priority)
+	};
+	struct Node {
+		enum Kind { EMPTY, LITERAL, SET, DOT, START, END, SEQUENCE, CHOICE, REPEAT, GROUP } kind;
+		unsigned char c;
+		int index;          // Class index or group number (-1 for no capture)
+		int min;
+		int max;            // -1 for unbounded
+		bool greedy;
+		vector<Node> children;
+	};
+
+	vector<Inst> program;
+	vector<bitset<256>> classes;
+	size_t groups;
+	bitset<256> firstBytes;     // Bytes a match can start with
+	bool anyStart;              // A match may be empty or start anywhere
+	bool literal;
+	string literalText;
+	Finder literalFinder;
+
+	// Parsing state
+	const string* source;
+	size_t pos;
+	bool veryMagic;
+	string error;
+
+	// In magic mode these need a backslash to be operators; in very magic
+	// mode they are operators unless escaped.
+	static bool isSwitchable(char c) {
+		return c == '(' || c == ')' || c == '|' || c == '+' || c == '?' || c == '=' || c == '{';
+	}
+	// Reports whether the next token is operator `op` and consumes it if so
+	bool accept(char op) {
+		const string& s = *source;
+		if (pos >= s.size()) return false;
+		bool escaped = s[pos] == '\\' && pos + 1 < s.size();
+		char c = escaped ? s[pos + 1] : s[pos];
+		if (c != op) return false;
+		bool isOperator = isSwitchable(c) ? (escaped != veryMagic) : !escaped;
+		if (!isOperator) return false;
+		pos += escaped ? 2 : 1;
+		return true;
+	}
+	bool atBranchEnd() {
+		size_t saved = pos;
+		bool end = pos >= source->size() || accept('|') || accept(')');
+		pos = saved;
+		return end;
+	}
+
+	int addClass(const bitset<256>& set) {
+		classes.push_back(set);
+		return static_cast<int>(classes.size()) - 1;
+	}
+	static bitset<256> namedClass(char name) {
+		bitset<256> set;
+		for (int c = 0; c < 256; ++c) {
+			bool digit = c >= '0' && c <= '9';
+			bool word = digit || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+			bool space = c == ' ' || c == '\t';
+			switch (tolower(name)) {
+			case 'd': set[c] = digit; break;
+			case 'w': set[c] = word; break;
+			case 's': set[c] = space; break;
 			}
 		}
+		if (isupper(static_cast<unsigned char>(name))) set.flip();
+		return set;
+	}
+	static Node leaf(Node::Kind kind, unsigned char c = 0, int index = -1) {
+		return Node{ kind, c, index, 0, 0, true, {} };
+	}
+
+	bool parseChoice(Node& out) {
+		Node choice = leaf(Node::CHOICE);
+		do {
+			Node sequence = leaf(Node::SEQUENCE);
+			if (!parseSequence(sequence)) return false;
+			choice.children.push_back(move(sequence));
+		} while (accept('|'));
+		if (choice.children.size() == 1) {
+			out = move(choice.children[0]);
+		}
 		else {
-			Cursor = lines[current_line];
-			for (char ch : copyBuffer) {
-				insert(ch);
+			out = move(choice);
+		}
+		return true;
+	}
+
+	bool parseSequence(Node& sequence) {
+		const string& s = *source;
+		bool first = true;
+		while (!atBranchEnd()) {
+			size_t saved = pos;
+			if (accept(')')) {
+				pos = saved;
+				break;
+			}
+			Node atom;
+			if (first && s[pos] == '^') {
+				pos++;
+				atom = leaf(Node::START);
 			}
+			else if (first && s[pos] == '*') {
+				pos++;
+				atom = leaf(Node::LITERAL, '*');   // Nothing to repeat yet
+			}
+			else if (!parseAtom(atom)) {
+				return false;
+			}
+			if (!parseQuantifiers(atom)) return false;
+			sequence.children.push_back(move(atom));
+			first = false;
 		}
+		return true;
 	}
-	void moveToStartOfLine() {
-		if (!lines[current_line]) {
-			return;
+
+	bool parseQuantifiers(Node& atom) {
+		while (pos < source->size()) {
+			int min, max;
+			bool greedy = true;
+			if ((*source)[pos] == '*') {
+				pos++;
+				min = 0;
+				max = -1;
+			}
+			else if (accept('+')) {
+				min = 1;
+				max = -1;
+			}
+			else if (accept('?') || accept('=')) {
+				min = 0;
+				max = 1;
+			}
+			else if (accept('{')) {
+				if (!parseBounds(min, max, greedy)) return false;
+			}
+			else {
+				return true;
+			}
+			if (atom.kind == Node::START || atom.kind == Node::END) {
+				error = "Nothing to repeat";
+				return false;
+			}
+			Node repeat = leaf(Node::REPEAT);
+			repeat.min = min;
+			repeat.max = max;
+			repeat.greedy = greedy;
+			repeat.children.push_back(move(atom));
+			atom = move(repeat);
 		}
-		Cursor = lines[current_line];
+		return true;
 	}
-	void moveToEndOfLine() {
-		if (!lines[current_line]) {
-			return;
+
+	// After "\{": [-][n][,[m]] followed by "}" or "\}"
+	bool parseBounds(int& low, int& high, bool& greedy) {
+		const string& s = *source;
+		auto number = [&]() {
+			int value = 0;
+			while (pos < s.size() && isdigit(static_cast<unsigned char>(s[pos]))) {
+				value = min(value * 10 + (s[pos++] - '0'), 100000);
+			}
+			return value;
+			};
+		auto atDigit = [&]() {
+			return pos < s.size() && isdigit(static_cast<unsigned char>(s[pos]));
+			};
+		if (pos < s.size() && s[pos] == '-') {
+			greedy = false;
+			pos++;
+		}
+		bool hasLow = atDigit();
+		low = number();
+		if (pos < s.size() && s[pos] == ',') {
+			pos++;
+			high = atDigit() ? number() : -1;
+		}
+		else {
+			high = hasLow ? low : -1;   // \{} is the same as *
 		}
-		auto temp = lines[current_line];
-		while (temp->next != nullptr) {
-			temp = temp->next;
+		if (pos < s.size() && s[pos] == '\\') pos++;
+		if (pos >= s.size() || s[pos] != '}') {
+			error = "Missing } after \\{";
+			return false;
 		}
-		Cursor = temp;
+		pos++;
+		if (high != -1 && high < low) swap(low, high);
+		return true;
 	}
-	void moveToNextWord() {
-		node* temp = Cursor;
-		if (!temp && current_line + 1 < lines.size()) {
-			current_line++;
-			Cursor = lines[current_line];
-			return;
+
+	bool parseAtom(Node& atom) {
+		const string& s = *source;
+		if (accept('(')) {
+			int group = groups < MAX_GROUPS ? static_cast<int>(groups++) : -1;
+			Node inner;
+			if (!parseChoice(inner)) return false;
+			if (!accept(')')) {
+				error = "Unmatched (";
+				return false;
+			}
+			atom = leaf(Node::GROUP, 0, group);
+			atom.children.push_back(move(inner));
+			return true;
 		}
-		while (true) {
-			if (!Cursor->next && current_line + 1 < lines.size()) {
-				current_line++;
-				Cursor = lines[current_line];
-				break;
+		char c = s[pos];
+		if (c == '.') {
+			pos++;
+			atom = leaf(Node::DOT);
+			return true;
+		}
+		if (c == '[') {
+			size_t saved = pos;
+			if (parseClass(atom)) return true;
+			pos = saved + 1;    // No closing ], so [ is literal
+			atom = leaf(Node::LITERAL, '[');
+			return true;
+		}
+		if (c == '$') {
+			pos++;
+			if (veryMagic || atBranchEnd()) {
+				atom = leaf(Node::END);
 			}
-			else if (!Cursor->next && current_line + 1 >= lines.size()) {
-				break;
+			else {
+				atom = leaf(Node::LITERAL, '$');
+			}
+			return true;
+		}
+		if (c == '^' && veryMagic) {
+			pos++;
+			atom = leaf(Node::START);
+			return true;
+		}
+		if (c == '\\' && pos + 1 < s.size()) {
+			char e = s[pos + 1];
+			if (isSwitchable(e) && !veryMagic) {
+				error = string("Unexpected \\") + e;
+				return false;
+			}
+			pos += 2;
+			if (e >= '1' && e <= '9') {
+				error = "Back-references are not supported";
+				return false;
+			}
+			if (strchr("dwsDWS", e)) {
+				atom = leaf(Node::SET, 0, addClass(namedClass(e)));
+			}
+			else if (e == 'n') {
+				atom = leaf(Node::END);     // Lines never contain the '\n' itself
 			}
 			else {
-				while (temp && temp->next && !isWordCharacter(temp->data)) {
-					temp = temp->next;
+				atom = leaf(Node::LITERAL, e == 't' ? '\t' : e == 'e' ? 27 : e);
+			}
+			return true;
+		}
+		if (veryMagic && isSwitchable(c)) {
+			error = string("Unexpected ") + c;
+			return false;
+		}
+		pos++;
+		atom = leaf(Node::LITERAL, c);
+		return true;
+	}
+
+	bool parseClass(Node& atom) {
+		const string& s = *source;
+		size_t i = pos + 1;
+		bool negate = i < s.size() && s[i] == '^';
+		if (negate) i++;
+		bitset<256> set;
+		bool first = true;
+		while (i < s.size() && (s[i] != ']' || first)) {
+			unsigned char low = s[i];
+			if (low == '\\' && i + 1 < s.size()) {
+				char e = s[++i];
+				if (strchr("dwsDWS", e)) {
+					set |= namedClass(e);
+					i++;
+					first = false;
+					continue;
+				}
+				low = e == 't' ? '\t' : e == 'e' ? 27 : e;
+			}
+			unsigned char high = low;
+			if (i + 2 < s.size() && s[i + 1] == '-' && s[i + 2] != ']') {
+				high = s[i + 2];
+				i += 2;
+			}
+			for (int c = low; c <= high; ++c) {
+				set[c] = true;
+			}
+			i++;
+			first = false;
+		}
+		if (i >= s.size()) return false;
+		pos = i + 1;
+		if (negate) {
+			set.flip();
+			set['\n'] = false;
+		}
+		atom = leaf(Node::SET, 0, addClass(set));
+		return true;
+	}
+
+	void emit(Op op, unsigned char c = 0, int x = 0, int y = 0) {
+		program.push_back(Inst{ op, c, x, y });
+	}
+	int here() const {
+		return static_cast<int>(program.size());
+	}
+
+	bool compile(const Node& node) {
+		if (program.size() > MAX_PROGRAM) {
+			error = "Pattern is too large";
+			return false;
+		}
+		switch (node.kind) {
+		case Node::EMPTY:
+			return true;
+		case Node::LITERAL:
+			emit(CHAR, node.c);
+			return true;
+		case Node::SET:
+			emit(CLASS, 0, node.index);
+			return true;
+		case Node::DOT:
+			emit(ANY);
+			return true;
+		case Node::START:
+			emit(BOL);
+			return true;
+		case Node::END:
+			emit(EOL);
+			return true;
+		case Node::SEQUENCE:
+			for (const Node& child : node.children) {
+				if (!compile(child)) return false;
+			}
+			return true;
+		case Node::GROUP:
+			if (node.index >= 0) emit(SAVE, 0, 2 * node.index);
+			if (!compile(node.children[0])) return false;
+			if (node.index >= 0) emit(SAVE, 0, 2 * node.index + 1);
+			return true;
+		case Node::CHOICE: {
+			vector<int> exits;
+			for (size_t i = 0; i < node.children.size(); ++i) {
+				int split = -1;
+				if (i + 1 < node.children.size()) {
+					split = here();
+					emit(SPLIT, 0, split + 1, 0);
 				}
-				while (temp && temp->next && isWordCharacter(temp->data)) {
-					temp = temp->next;
+				if (!compile(node.children[i])) return false;
+				if (split >= 0) {
+					exits.push_back(here());
+					emit(JMP);
+					program[split].y = here();
 				}
-				while (temp && temp->next && !isWordCharacter(temp->data)) {
-					temp = temp->next;
+			}
+			for (int exit : exits) {
+				program[exit].x = here();
+			}
+			return true;
+		}
+		case Node::REPEAT: {
+			const Node& body = node.children[0];
+			for (int i = 0; i < node.min; ++i) {
+				if (!compile(body)) return false;
+			}
+			if (node.max == -1) {
+				int loop = here();
+				emit(SPLIT);
+				if (!compile(body)) return false;
+				emit(JMP, 0, loop);
+				setSplit(loop, loop + 1, here(), node.greedy);
+				return true;
+			}
+			vector<int> splits;
+			for (int i = node.min; i < node.max; ++i) {
+				splits.push_back(here());
+				emit(SPLIT);
+				if (!compile(body)) return false;
+			}
+			for (int split : splits) {
+				setSplit(split, split + 1, here(), node.greedy);
+			}
+			return true;
+		}
+		}
+		return true;
+	}
+	void setSplit(int at, int body, int skip, bool greedy) {
+		program[at].x = greedy ? body : skip;
+		program[at].y = greedy ? skip : body;
+	}
+
+	void findFirstBytes() {
+		vector<bool> seen(program.size(), false);
+		vector<int> work(1, 0);
+		while (!work.empty()) {
+			int pc = work.back();
+			work.pop_back();
+			if (seen[pc]) continue;
+			seen[pc] = true;
+			const Inst& inst = program[pc];
+			switch (inst.op) {
+			case CHAR: firstBytes[inst.c] = true; break;
+			case CLASS: firstBytes |= classes[inst.x]; break;
+			case ANY: firstBytes.set(); firstBytes['\n'] = false; break;
+			case JMP: work.push_back(inst.x); break;
+			case SPLIT: work.push_back(inst.x); work.push_back(inst.y); break;
+			case SAVE: case BOL: work.push_back(pc + 1); break;
+			case EOL: case MATCH: anyStart = true; break;
+			}
+		}
+	}
+
+	static bool isLiteral(const Node& node, string& text) {
+		if (node.kind == Node::LITERAL) {
+			text += static_cast<char>(node.c);
+			return true;
+		}
+		if (node.kind != Node::SEQUENCE) return false;
+		for (const Node& child : node.children) {
+			if (!isLiteral(child, text)) return false;
+		}
+		return true;
+	}
+
+	Regex() : groups(1), anyStart(false), literal(false), literalFinder(""), source(nullptr), pos(0), veryMagic(false) {}
+
+public:
+	// Compiles `pattern`; returns nullptr and sets `error` when it is invalid.
+	static shared_ptr<const Regex> compile(const string& pattern, string& error) {
+		shared_ptr<Regex> re(new Regex());
+		string body = pattern;
+		if (body.compare(0, 2, "\\v") == 0) {
+			re->veryMagic = true;
+			body.erase(0, 2);
+		}
+		else if (body.compare(0, 2, "\\m") == 0) {
+			body.erase(0, 2);
+		}
+		re->source = &body;
+		Node root;
+		bool ok = re->parseChoice(root);
+		if (ok && re->pos < body.size()) {
+			re->error = "Unmatched )";
+			ok = false;
+		}
+		string text;
+		if (ok && isLiteral(root, text) && !text.empty()) {
+			re->literal = true;
+			re->literalText = text;
+			re->literalFinder = Finder(text);
+		}
+		ok = ok && re->compile(root);
+		if (ok && re->program.size() > MAX_PROGRAM) {
+			re->error = "Pattern is too large";
+			ok = false;
+		}
+		re->source = nullptr;
+		if (!ok) {
+			error = re->error;
+			return nullptr;
+		}
+		re->emit(MATCH);
+		re->findFirstBytes();
+		return re;
+	}
+
+	bool isLiteral() const {
+		return literal;
+	}
+	const string& literalPattern() const {
+		return literalText;
+	}
+	const Finder& finder() const {
+		return literalFinder;
+	}
+	size_t groupCount() const {
+		return groups;
+	}
+
+	// Per-thread matching state: the lazily built DFA and the Pike VM
+	// thread lists. A Regex can be shared; a Matcher cannot.
+	class Matcher {
+		static constexpr size_t MAX_STATES = 2000;
+		struct State {
+			vector<int> pcs;
+			bool match;
+			int atEnd;          // -1 unknown, else whether $ completes a match
+			int next[256];
+		};
+		struct ThreadList {
+			vector<int> sparse;
+			vector<int> dense;
+			vector<size_t> caps;    // `slots` entries per thread
+			size_t count;
+			bool contains(int pc) const {
+				int i = sparse[pc];
+				return i < static_cast<int>(count) && dense[i] == pc;
+			}
+		};
+		struct Pending {
+			int pc;
+			int slot;           // >= 0: restore caps[slot] to value instead
+			size_t value;       // Saved capture, or the position for backtrack()
+		};
+		// Texts are matched by backtrack() while (bytes + 1) * instructions
+		// stays below this many bits of visited states
+		static constexpr size_t BACKTRACK_BITS = 256 * 1024;
+
+		const Regex& re;
+		size_t slots;           // Capture positions per thread
+		vector<State> states;
+		map<vector<int>, int> stateIds;
+		int startState;
+		ThreadList current;
+		ThreadList next;
+		vector<Pending> stack;
+		vector<uint64_t> visited;
+		vector<int> marks;
+		int generation;
+
+		// Adds the epsilon closure of pc to `set`, stopping at instructions
+		// that consume a byte; ^ only holds at the line start and $ at its end.
+		void closure(int pc, bool atStart, bool atEnd, vector<int>& set) {
+			vector<int> work(1, pc);
+			while (!work.empty()) {
+				int p = work.back();
+				work.pop_back();
+				if (marks[p] == generation) continue;
+				marks[p] = generation;
+				const Inst& inst = re.program[p];
+				switch (inst.op) {
+				case JMP: work.push_back(inst.x); break;
+				case SPLIT: work.push_back(inst.y); work.push_back(inst.x); break;
+				case SAVE: work.push_back(p + 1); break;
+				case BOL: if (atStart) work.push_back(p + 1); break;
+				case EOL: if (atEnd) work.push_back(p + 1); else set.push_back(p); break;
+				default: set.push_back(p); break;
+				}
+			}
+		}
+		int intern(vector<int>& pcs) {
+			sort(pcs.begin(), pcs.end());
+			auto found = stateIds.find(pcs);
+			if (found != stateIds.end()) return found->second;
+			State state;
+			state.pcs = pcs;
+			state.match = false;
+			state.atEnd = -1;
+			for (int pc : pcs) {
+				if (re.program[pc].op == MATCH) state.match = true;
+			}
+			fill(begin(state.next), end(state.next), -1);
+			states.push_back(move(state));
+			stateIds[pcs] = static_cast<int>(states.size()) - 1;
+			return static_cast<int>(states.size()) - 1;
+		}
+		void resetStates() {
+			states.clear();
+			stateIds.clear();
+			generation++;
+			vector<int> pcs;
+			closure(0, true, false, pcs);
+			startState = intern(pcs);
+		}
+		static bool consumes(const Regex& re, const Inst& inst, unsigned char c) {
+			switch (inst.op) {
+			case CHAR: return inst.c == c;
+			case CLASS: return re.classes[inst.x][c];
+			case ANY: return c != '\n';
+			default: return false;
+			}
+		}
+		int step(int s, unsigned char c) {
+			if (states[s].next[c] >= 0) return states[s].next[c];
+			if (states.size() >= MAX_STATES) {
+				// Start over rather than grow without bound; matching stays
+				// linear, only the cache is rebuilt
+				vector<int> pcs = states[s].pcs;
+				resetStates();
+				s = intern(pcs);
+			}
+			generation++;
+			vector<int> pcs;
+			const vector<int> from = states[s].pcs;
+			for (int pc : from) {
+				if (consumes(re, re.program[pc], c)) closure(pc + 1, false, false, pcs);
+			}
+			closure(0, false, false, pcs);     // A match may also start at the next byte
+			int target = intern(pcs);
+			states[s].next[c] = target;
+			return target;
+		}
+		bool matchesAtEnd(int s) {
+			if (states[s].atEnd < 0) {
+				bool match = false;
+				generation++;
+				for (int pc : states[s].pcs) {
+					if (re.program[pc].op != EOL) continue;
+					vector<int> pcs;
+					closure(pc + 1, false, true, pcs);
+					for (int p : pcs) {
+						if (re.program[p].op == MATCH) match = true;
+					}
+				}
+				states[s].atEnd = match;
+			}
+			return states[s].atEnd == 1;
+		}
+
+		void clear(ThreadList& list) {
+			list.count = 0;
+		}
+		// Adds the thread at pc with captures `caps` to `list`, following
+		// epsilon moves in priority order.
+		void addThread(ThreadList& list, int pc0, size_t at, size_t length, size_t* caps) {
+			stack.push_back(Pending{ pc0, -1, 0 });
+			while (!stack.empty()) {
+				Pending item = stack.back();
+				stack.pop_back();
+				if (item.slot >= 0) {
+					caps[item.slot] = item.value;
+					continue;
+				}
+				int pc = item.pc;
+				if (list.contains(pc)) continue;
+				list.sparse[pc] = static_cast<int>(list.count);
+				list.dense[list.count] = pc;
+				const Inst& inst = re.program[pc];
+				switch (inst.op) {
+				case JMP:
+					stack.push_back(Pending{ inst.x, -1, 0 });
+					break;
+				case SPLIT:
+					stack.push_back(Pending{ inst.y, -1, 0 });
+					stack.push_back(Pending{ inst.x, -1, 0 });
+					break;
+				case SAVE:
+					stack.push_back(Pending{ 0, inst.x, caps[inst.x] });
+					caps[inst.x] = at;
+					stack.push_back(Pending{ pc + 1, -1, 0 });
+					break;
+				case BOL:
+					if (at == 0) stack.push_back(Pending{ pc + 1, -1, 0 });
+					break;
+				case EOL:
+					if (at == length) stack.push_back(Pending{ pc + 1, -1, 0 });
+					break;
+				default:
+					// Only threads that wait for a byte or match need captures
+					copy(caps, caps + slots, list.caps.begin() + list.count * slots);
+					break;
+				}
+				list.count++;
+			}
+		}
+
+	public:
+		explicit Matcher(const Regex& re) : re(re), slots(2 * re.groups), startState(0), generation(0) {
+			size_t n = re.program.size();
+			marks.assign(n, 0);
+			for (ThreadList* list : { &current, &next }) {
+				list->sparse.assign(n, 0);
+				list->dense.assign(n, 0);
+				list->caps.assign(n * slots, 0);
+				list->count = 0;
+			}
+			if (!re.literal) resetStates();
+		}
+
+		// Whether `text` contains a match anywhere, via the DFA
+		bool contains(string_view text) {
+			if (re.literal) return re.literalFinder.find(text) != string::npos;
+			int s = startState;
+			if (states[s].match) return true;
+			for (unsigned char c : text) {
+				s = step(s, c);
+				if (states[s].match) return true;
+			}
+			return matchesAtEnd(s);
+		}
+
+		// Depth-first search in priority order that never visits the same
+		// (instruction, position) twice: a state that failed once fails on
+		// every path, so this is as linear as the Pike VM but cheaper on the
+		// short texts it is used for.
+		bool backtrack(string_view text, size_t from, size_t* caps) {
+			size_t width = re.program.size();
+			visited.assign(((text.size() - from + 1) * width + 63) / 64, 0);
+			for (size_t start = from; start <= text.size(); ++start) {
+				if (!re.anyStart) {
+					while (start < text.size() && !re.firstBytes[static_cast<unsigned char>(text[start])]) start++;
+					if (start == text.size()) break;
+				}
+				caps[0] = start;
+				stack.clear();
+				stack.push_back(Pending{ 0, -1, start });
+				while (!stack.empty()) {
+					Pending item = stack.back();
+					stack.pop_back();
+					if (item.slot >= 0) {
+						caps[item.slot] = item.value;
+						continue;
+					}
+					int pc = item.pc;
+					size_t at = item.value;
+					size_t bit = (at - from) * width + pc;
+					if (visited[bit / 64] >> (bit % 64) & 1) continue;
+					visited[bit / 64] |= uint64_t(1) << (bit % 64);
+					const Inst& inst = re.program[pc];
+					switch (inst.op) {
+					case JMP:
+						stack.push_back(Pending{ inst.x, -1, at });
+						break;
+					case SPLIT:
+						stack.push_back(Pending{ inst.y, -1, at });
+						stack.push_back(Pending{ inst.x, -1, at });
+						break;
+					case SAVE:
+						stack.push_back(Pending{ 0, inst.x, caps[inst.x] });
+						caps[inst.x] = at;
+						stack.push_back(Pending{ pc + 1, -1, at });
+						break;
+					case BOL:
+						if (at == 0) stack.push_back(Pending{ pc + 1, -1, at });
+						break;
+					case EOL:
+						if (at == text.size()) stack.push_back(Pending{ pc + 1, -1, at });
+						break;
+					case MATCH:
+						caps[1] = at;
+						return true;
+					default:
+						if (at < text.size() && consumes(re, inst, text[at])) {
+							stack.push_back(Pending{ pc + 1, -1, at + 1 });
+						}
+						break;
+					}
+				}
+			}
+			return false;
+		}
+
+		// Leftmost match in `text` starting at or after `from`. caps[2k] and
+		// caps[2k + 1] receive the bounds of group k (string::npos if unset).
+		bool find(string_view text, size_t from, size_t* caps) {
+			fill(caps, caps + 2 * MAX_GROUPS, string::npos);
+			if (re.literal) {
+				size_t hit = re.literalFinder.find(text, from);
+				if (hit == string::npos) return false;
+				caps[0] = hit;
+				caps[1] = hit + re.literalText.size();
+				return true;
+			}
+			if (from > text.size()) return false;
+			if ((text.size() - from + 1) * re.program.size() <= BACKTRACK_BITS) {
+				return backtrack(text, from, caps);
+			}
+			size_t working[2 * MAX_GROUPS];
+			bool matched = false;
+			clear(current);
+			for (size_t at = from; at <= text.size(); ++at) {
+				if (!matched) {
+					if (current.count == 0 && !re.anyStart) {
+						// Nothing running: go to the next byte a match can start with
+						while (at < text.size() && !re.firstBytes[static_cast<unsigned char>(text[at])]) at++;
+						if (at == text.size()) break;
+					}
+					// Started last, so lower priority than every running thread
+					fill(working, working + slots, string::npos);
+					working[0] = at;
+					addThread(current, 0, at, text.size(), working);
+				}
+				else if (current.count == 0) {
+					break;
+				}
+				clear(next);
+				for (size_t i = 0; i < current.count; ++i) {
+					int pc = current.dense[i];
+					const size_t* threadCaps = &current.caps[i * slots];
+					const Inst& inst = re.program[pc];
+					if (inst.op == MATCH) {
+						// Lower priority threads can no longer win
+						matched = true;
+						copy(threadCaps, threadCaps + slots, caps);
+						caps[1] = at;
+						break;
+					}
+					if (at < text.size() && consumes(re, inst, text[at])) {
+						copy(threadCaps, threadCaps + slots, working);
+						addThread(next, pc + 1, at + 1, text.size(), working);
+					}
+				}
+				swap(current, next);
+			}
+			return matched;
+		}
+	};
+
+	// Expands \0-\9 and & in a :s replacement; \r breaks the line, \t is a
+	// tab and \& or \\ are taken literally.
+	static void expand(const string& replacement, string_view line, const size_t* caps, string& out) {
+		for (size_t i = 0; i < replacement.size(); ++i) {
+			char c = replacement[i];
+			int group = -1;
+			if (c == '&') {
+				group = 0;
+			}
+			else if (c == '\\' && i + 1 < replacement.size()) {
+				char e = replacement[++i];
+				if (e >= '0' && e <= '9') group = e - '0';
+				else if (e == 'r' || e == 'n') out += '\n';
+				else if (e == 't') out += '\t';
+				else out += e;
+			}
+			else {
+				out += c;
+			}
+			if (group >= 0 && group < static_cast<int>(MAX_GROUPS) && caps[2 * group] != string::npos && caps[2 * group + 1] != string::npos) {
+				out.append(line.substr(caps[2 * group], caps[2 * group + 1] - caps[2 * group]));
+			}
+		}
+	}
+
+	// Calls f(caps) for each match :s replaces in `line`: only the first
+	// unless `global`, never overlapping, and no empty match right where the
+	// previous one ended. Returns how many there were.
+	template <typename F>
+	static size_t forEachMatch(Matcher& matcher, string_view line, bool global, F f) {
+		size_t caps[2 * MAX_GROUPS];
+		size_t count = 0;
+		size_t from = 0;
+		size_t previousEnd = string::npos;
+		if (!matcher.contains(line)) return 0;
+		while (from <= line.size() && matcher.find(line, from, caps)) {
+			from = caps[1] > caps[0] ? caps[1] : caps[1] + 1;
+			if (caps[0] == caps[1] && caps[0] == previousEnd) continue;
+			f(caps);
+			previousEnd = caps[1];
+			count++;
+			if (!global) break;
+		}
+		return count;
+	}
+};
+
+// Optional per-buffer trigram index for large buffers. Lines are grouped in
+// blocks, and every block keeps a bitmap of the trigrams on its lines, so a
+// search only verifies blocks holding every trigram of the pattern. The first
+// build runs on a background thread over the text as loaded; edits made
+// meanwhile are queued and replayed once it is adopted. Afterwards an edit
+// only marks the blocks it touches as stale, and stale blocks are re-read at
+// the next query.
+class TrigramIndex {
+public:
+	static constexpr size_t MIN_BYTES = 1 << 20;     // Smaller buffers are scanned directly
+	static constexpr size_t BLOCK_LINES = 32;
+	static constexpr size_t MAX_BLOCK_LINES = 4 * BLOCK_LINES;
+
+private:
+	static constexpr size_t FILTER_BITS = 2048;
+	struct Block {
+		size_t lines;
+		bool stale;
+		uint64_t bits[FILTER_BITS / 64];
+	};
+	struct LineChange {
+		size_t line;
+		size_t removed;
+		size_t added;
+	};
+
+	vector<Block> blocks;
+	vector<size_t> fenwick;             // Prefix sums of block line counts, 1-based
+	bool enabled;
+	thread builder;
+	atomic<bool> built;
+	atomic<bool> cancelled;
+	vector<Block> builtBlocks;          // Only touched by the builder until `built`
+	vector<LineChange> pendingChanges;  // Edits made while the builder runs
+
+	static size_t hash(const char* p) {
+		uint32_t trigram = (uint32_t(static_cast<unsigned char>(p[0])) << 16)
+			| (uint32_t(static_cast<unsigned char>(p[1])) << 8) | static_cast<unsigned char>(p[2]);
+		return (trigram * 2654435761u) >> (32 - 11);
+	}
+	static void addLine(Block& block, const char* data, size_t length) {
+		for (size_t i = 0; i + 2 < length; ++i) {
+			size_t h = hash(data + i);
+			block.bits[h / 64] |= uint64_t(1) << (h % 64);
+		}
+	}
+	static Block emptyBlock(size_t lines, bool stale) {
+		Block block;
+		block.lines = lines;
+		block.stale = stale;
+		memset(block.bits, 0, sizeof(block.bits));
+		return block;
+	}
+
+	void rebuildFenwick() {
+		fenwick.assign(blocks.size() + 1, 0);
+		for (size_t i = 1; i <= blocks.size(); ++i) {
+			fenwick[i] += blocks[i - 1].lines;
+			size_t parent = i + (i & (0 - i));
+			if (parent <= blocks.size()) fenwick[parent] += fenwick[i];
+		}
+	}
+	void fenwickAdd(size_t block, size_t delta) {
+		for (size_t i = block + 1; i <= blocks.size(); i += i & (0 - i)) {
+			fenwick[i] += delta;
+		}
+	}
+	// Block holding `line`; `firstLine` receives the block's first line
+	size_t blockOf(size_t line, size_t& firstLine) const {
+		size_t n = blocks.size();
+		size_t step = 1;
+		while (step * 2 <= n) step *= 2;
+		size_t pos = 0;
+		size_t sum = 0;
+		for (; step > 0; step /= 2) {
+			if (pos + step <= n && sum + fenwick[pos + step] <= line) {
+				pos += step;
+				sum += fenwick[pos];
+			}
+		}
+		if (pos >= n) {
+			pos = n - 1;
+			sum -= blocks[pos].lines;
+		}
+		firstLine = sum;
+		return pos;
+	}
+
+	bool building() const {
+		return builder.joinable();
+	}
+	void adoptIfBuilt() {
+		if (!building() || !built.load(memory_order_acquire)) return;
+		builder.join();
+		blocks = move(builtBlocks);
+		rebuildFenwick();
+		for (const LineChange& change : pendingChanges) {
+			apply(change);
+		}
+		pendingChanges.clear();
+	}
+
+	void apply(const LineChange& change) {
+		size_t first;
+		size_t b = blockOf(change.line, first);
+		blocks[b].stale = true;
+		if (change.removed == 0 && change.added == 0) return;
+
+		// The removed lines follow `line`, in this block and the next ones
+		size_t remaining = change.removed;
+		size_t take = min(remaining, first + blocks[b].lines - change.line - 1);
+		blocks[b].lines -= take;
+		remaining -= take;
+		bool reshaped = false;
+		for (size_t k = b + 1; remaining > 0 && k < blocks.size(); ++k) {
+			take = min(remaining, blocks[k].lines);
+			blocks[k].lines -= take;
+			remaining -= take;
+			reshaped = reshaped || blocks[k].lines == 0;
+		}
+		blocks[b].lines += change.added;
+
+		if (blocks[b].lines > MAX_BLOCK_LINES) {
+			size_t lines = blocks[b].lines;
+			vector<Block> pieces;
+			for (size_t done = 0; done < lines; done += BLOCK_LINES) {
+				pieces.push_back(emptyBlock(min(BLOCK_LINES, lines - done), true));
+			}
+			blocks.erase(blocks.begin() + b);
+			blocks.insert(blocks.begin() + b, pieces.begin(), pieces.end());
+			reshaped = true;
+		}
+		if (reshaped) {
+			blocks.erase(remove_if(blocks.begin(), blocks.end(), [](const Block& block) { return block.lines == 0; }), blocks.end());
+			rebuildFenwick();
+		}
+		else if (change.removed > 0) {
+			rebuildFenwick();   // Counts may have changed in several blocks
+		}
+		else {
+			fenwickAdd(b, change.added);
+		}
+	}
+
+	// Re-reads the lines of every block an edit touched
+	void refresh(const PieceTable& text) {
+		string scratch;
+		size_t first = 0;
+		for (Block& block : blocks) {
+			if (block.stale) {
+				memset(block.bits, 0, sizeof(block.bits));
+				for (size_t line = first; line < first + block.lines; ++line) {
+					string_view view = text.lineView(line, scratch);
+					addLine(block, view.data(), view.size());
+				}
+				block.stale = false;
+			}
+			first += block.lines;
+		}
+	}
+
+public:
+	TrigramIndex() : enabled(false), built(false), cancelled(false) {}
+	TrigramIndex(const TrigramIndex&) = delete;
+	TrigramIndex& operator=(const TrigramIndex&) = delete;
+	~TrigramIndex() {
+		stop();
+	}
+
+	// Drops the index; must be called before the loaded text goes away
+	void stop() {
+		if (building()) {
+			cancelled = true;
+			builder.join();
+		}
+		enabled = false;
+		vector<Block>().swap(blocks);
+		vector<size_t>().swap(fenwick);
+		vector<Block>().swap(builtBlocks);
+		pendingChanges.clear();
+	}
+
+	// Starts indexing a freshly loaded buffer in the background
+	void start(const PieceTable& text) {
+		stop();
+		if (text.length() < MIN_BYTES) return;
+		enabled = true;
+		built = false;
+		cancelled = false;
+		string_view loaded = text.loadedText();
+		builder = thread([this, loaded]() {
+			vector<Block> result;
+			const char* p = loaded.data();
+			const char* end = p + loaded.size();
+			while (!cancelled) {
+				Block block = emptyBlock(0, false);
+				while (block.lines < BLOCK_LINES) {
+					const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+					if (!lineEnd) lineEnd = end;
+					addLine(block, p, lineEnd - p);
+					block.lines++;
+					p = lineEnd + 1;
+					if (lineEnd == end) break;
+				}
+				result.push_back(block);
+				if (p > end) break;
+			}
+			builtBlocks = move(result);
+			built.store(true, memory_order_release);
+			});
+	}
+
+	void linesChanged(size_t line, size_t removed, size_t added) {
+		if (!enabled) return;
+		adoptIfBuilt();
+		if (building()) {
+			pendingChanges.push_back(LineChange{ line, removed, added });
+		}
+		else {
+			apply(LineChange{ line, removed, added });
+		}
+	}
+
+	// Line ranges [first, last) that may hold `pattern`. Returns false when
+	// the index cannot narrow the search (disabled, still building, or the
+	// pattern is too short or spans lines).
+	bool candidates(const PieceTable& text, const string& pattern, vector<pair<size_t, size_t>>& ranges) {
+		adoptIfBuilt();
+		if (!enabled || building() || pattern.size() < 3 || pattern.find('\n') != string::npos) {
+			return false;
+		}
+		refresh(text);
+		vector<size_t> hashes;
+		for (size_t i = 0; i + 2 < pattern.size(); ++i) {
+			hashes.push_back(hash(pattern.data() + i));
+		}
+		size_t first = 0;
+		for (const Block& block : blocks) {
+			bool possible = all_of(hashes.begin(), hashes.end(), [&](size_t h) {
+				return (block.bits[h / 64] >> (h % 64)) & 1;
+				});
+			if (possible) {
+				if (!ranges.empty() && ranges.back().second == first) {
+					ranges.back().second += block.lines;
+				}
+				else {
+					ranges.push_back(make_pair(first, first + block.lines));
+				}
+			}
+			first += block.lines;
+		}
+		return true;
+	}
+
+	size_t memoryUsage() const {
+		return (blocks.capacity() + builtBlocks.capacity()) * sizeof(Block) + fenwick.capacity() * sizeof(size_t);
+	}
+};
+
+class SearchEngine {
+public:
+	struct Match {
+		size_t line;
+		size_t column;
+		bool operator<(const Match& other) const {
+			return line != other.line ? line < other.line : column < other.column;
+		}
+	};
+
+	string lastPattern;
+	size_t lastMatchLine;
+	size_t lastMatchColumn;
+	vector<Match> matches;      // Every match of lastPattern in document order
+	size_t currentMatch;        // Index of the last match in `matches`
+	string lastError;           // Why the last pattern did not compile
+	SearchEngine() : lastMatchLine(0), lastMatchColumn(0), currentMatch(0), indexing(true), matchesVersion(0) {}
+
+	// Compiled form of `pattern`, from the cache when it was used recently
+	shared_ptr<const Regex> compile(const string& pattern) {
+		static constexpr size_t CACHE_SIZE = 32;
+		lastError.clear();
+		auto cached = compiled.find(pattern);
+		if (cached != compiled.end()) return cached->second;
+		shared_ptr<const Regex> re = Regex::compile(pattern, lastError);
+		if (!re) return nullptr;
+		if (compiled.size() >= CACHE_SIZE) compiled.clear();
+		compiled[pattern] = re;
+		return re;
+	}
+
+	// Splits the body of :s/pattern/replacement/[flags] (after "s/"); "\/"
+	// stands for a slash in either part and the final slash may be left out.
+	// Flags are g, for every match on a line, and e, for no error when
+	// nothing matches.
+	static bool parseSubstitute(const string& body, string& pattern, string& replacement, bool& global, bool& missingOk) {
+		vector<string> parts(1);
+		for (size_t i = 0; i < body.size(); ++i) {
+			if (body[i] == '\\' && i + 1 < body.size()) {
+				if (body[i + 1] != '/') parts.back() += '\\';
+				parts.back() += body[++i];
+			}
+			else if (body[i] == '/' && parts.size() < 3) {
+				parts.emplace_back();
+			}
+			else {
+				parts.back() += body[i];
+			}
+		}
+		if (parts.size() < 2 || parts[0].empty()) return false;
+		pattern = parts[0];
+		replacement = parts[1];
+		global = missingOk = false;
+		if (parts.size() == 3) {
+			for (char flag : parts[2]) {
+				if (flag == 'g') global = true;
+				else if (flag == 'e') missingOk = true;
+				else return false;
+			}
+		}
+		return true;
+	}
+
+	// Indexes `text` when it is large enough and indexing is on; its edits
+	// must then be passed on to linesChanged()
+	void attach(const PieceTable& text) {
+		if (indexing) {
+			index.start(text);
+		}
+	}
+	// Whether attach() builds the index. Without it every search scans the
+	// text, which suits a single pass over a file.
+	void useIndex(bool use) {
+		indexing = use;
+	}
+	void linesChanged(size_t line, size_t removed, size_t added) {
+		index.linesChanged(line, removed, added);
+	}
+	// Must be called before `text` is reloaded
+	void detach() {
+		index.stop();
+		vector<Match>().swap(matches);
+	}
+	size_t memoryUsage() const {
+		return index.memoryUsage() + matches.capacity() * sizeof(Match);
+	}
+
+	bool search(const PieceTable& text, const string& str) {
+		lastPattern = str;
+		pattern = compile(str);
+		collect(text);
+		if (!matches.empty()) { // Found a match
+			select(0);
+			return true;
+		}
+		lastMatchLine = 0;
+		lastMatchColumn = 0;
+		return false;
+	}
+
+
+	bool findNext(const PieceTable& text) {
+		// First match after the last one, found by binary search
+		refresh(text);
+		size_t i = upper_bound(matches.begin(), matches.end(), Match{ lastMatchLine, lastMatchColumn }) - matches.begin();
+		if (i == matches.size()) return false; // No more occurrences found
+		select(i);
+		return true;
+	}
+
+	bool findPrevious(const PieceTable& text) {
+		refresh(text);
+		size_t i = lower_bound(matches.begin(), matches.end(), Match{ lastMatchLine, lastMatchColumn }) - matches.begin();
+		if (i == 0) return false; // No previous occurrences found
+		select(i - 1);
+		return true;
+	}
+
+	// True while `matches` still describes the text
+	bool isCurrent(const PieceTable& text) const {
+		return !lastPattern.empty() && matchesVersion == text.version();
+	}
+	size_t matchCount() const {
+		return matches.size();
+	}
+
+	struct SubstituteCount {
+		size_t substitutions;
+		size_t lines;       // Lines with at least one substitution
+	};
+
+	// Finds what :s/re/replacement/ changes on lines [first, last]. Chunks
+	// of lines are matched in parallel, each with its own Matcher; `edits`
+	// lists the spans whose text actually changes, in document order.
+	SubstituteCount substitutions(const PieceTable& text, const Regex& re, size_t first, size_t last, const string& replacement, bool global, vector<PieceTable::Splice>& edits) {
+		const size_t CHUNK_BYTES = 1 << 20;
+		edits.clear();
+		last = min(last, text.lineCount() - 1);
+		if (first > last) return SubstituteCount{ 0, 0 };
+
+		ThreadPool& pool = ThreadPool::shared();
+		size_t bytes = text.lineEnd(last) - text.lineStart(first);
+		size_t lines = last - first + 1;
+		size_t chunkCount = min(lines, max<size_t>(1, min(bytes / CHUNK_BYTES, (pool.size() + 1) * 4)));
+		size_t chunkLines = lines / chunkCount + 1;
+		vector<vector<PieceTable::Splice>> found(chunkCount);
+		vector<SubstituteCount> counts(chunkCount, SubstituteCount{ 0, 0 });
+		auto scanChunk = [&](size_t chunk) {
+			Regex::Matcher matcher(re);
+			string scratch;
+			string expanded;
+			size_t end = min(last + 1, first + (chunk + 1) * chunkLines);
+			for (size_t line = first + chunk * chunkLines; line < end; ++line) {
+				string_view view = text.lineView(line, scratch);
+				size_t lineStart = string::npos;
+				size_t count = Regex::forEachMatch(matcher, view, global, [&](const size_t* caps) {
+					expanded.clear();
+					Regex::expand(replacement, view, caps, expanded);
+					string_view old = view.substr(caps[0], caps[1] - caps[0]);
+					if (expanded == old) return;
+					if (lineStart == string::npos) lineStart = text.lineStart(line);
+					found[chunk].push_back(PieceTable::Splice{ lineStart + caps[0], old.size(), expanded });
+					});
+				counts[chunk].substitutions += count;
+				counts[chunk].lines += count > 0;
+			}
+			};
+		if (bytes < 2 * CHUNK_BYTES) {
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+				scanChunk(chunk);
+			}
+		}
+		else {
+			pool.parallelFor(chunkCount, scanChunk);
+		}
+		SubstituteCount total{ 0, 0 };
+		for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+			total.substitutions += counts[chunk].substitutions;
+			total.lines += counts[chunk].lines;
+			for (PieceTable::Splice& edit : found[chunk]) {
+				edits.push_back(move(edit));
+			}
+		}
+		return total;
+	}
+
+private:
+	bool indexing;              // See useIndex()
+	size_t matchesVersion;      // PieceTable::version() that `matches` belongs to
+	TrigramIndex index;
+	shared_ptr<const Regex> pattern;                    // lastPattern, compiled
+	map<string, shared_ptr<const Regex>> compiled;
+
+	void select(size_t i) {
+		currentMatch = i;
+		lastMatchLine = matches[i].line;
+		lastMatchColumn = matches[i].column;
+	}
+
+	void refresh(const PieceTable& text) {
+		if (!isCurrent(text)) collect(text);
+	}
+
+	// Finds every match of lastPattern. When the trigram index can narrow
+	// the search only the candidate lines are verified. The text to scan is
+	// cut into byte ranges that are scanned in parallel; a range owns the
+	// matches that start inside it, and the per-range lists are joined in order.
+	void collect(const PieceTable& text) {
+		const size_t CHUNK_BYTES = 1 << 20;
+		matches.clear();
+		matchesVersion = text.version();
+		if (lastPattern.empty() || !pattern) return;
+
+		ThreadPool& pool = ThreadPool::shared();
+		size_t length = text.length();
+		size_t chunkCount = max<size_t>(1, min(length / CHUNK_BYTES, (pool.size() + 1) * 4));
+		if (!pattern->isLiteral()) {
+			collectLines(text, chunkCount, length >= 2 * CHUNK_BYTES);
+			return;
+		}
+		size_t chunkBytes = length / chunkCount + 1;
+		vector<pair<size_t, size_t>> ranges;
+		size_t total = 0;
+		auto addRange = [&](size_t from, size_t to) {
+			total += to - from;
+			for (; from < to; from += chunkBytes) {
+				ranges.push_back(make_pair(from, min(to, from + chunkBytes)));
+			}
+			};
+		vector<pair<size_t, size_t>> lines;
+		if (index.candidates(text, pattern->literalPattern(), lines)) {
+			for (const pair<size_t, size_t>& range : lines) {
+				addRange(text.lineStart(range.first), text.lineEnd(range.second - 1));
+			}
+		}
+		else {
+			addRange(0, length);
+		}
+
+		const Finder& finder = pattern->finder();
+		vector<vector<Match>> found(ranges.size());
+		auto scanChunk = [&](size_t chunk) {
+			size_t from = ranges[chunk].first;
+			size_t to = ranges[chunk].second;
+			size_t line = 0;
+			size_t lineStart = 0;
+			size_t lineEnd = 0;     // [lineStart, lineEnd] bounds the line of the previous hit
+			for (size_t hit; (hit = text.find(finder, from, to)) != string::npos; from = hit + 1) {
+				if (found[chunk].empty() || hit > lineEnd) {
+					line = text.lineOf(hit);
+					lineStart = text.lineStart(line);
+					lineEnd = text.lineEnd(line);
+				}
+				found[chunk].push_back(Match{ line, hit - lineStart });
+			}
+			};
+		if (total < 2 * CHUNK_BYTES) {
+			for (size_t chunk = 0; chunk < ranges.size(); ++chunk) {
+				scanChunk(chunk);
+			}
+		}
+		else {
+			pool.parallelFor(ranges.size(), scanChunk);
+		}
+		for (vector<Match>& part : found) {
+			matches.insert(matches.end(), part.begin(), part.end());
+		}
+	}
+
+	// Regular expressions are matched line by line: each chunk of lines gets
+	// its own Matcher, and only lines its DFA accepts go through the Pike VM.
+	void collectLines(const PieceTable& text, size_t chunkCount, bool parallel) {
+		size_t lineCount = text.lineCount();
+		size_t chunkLines = lineCount / chunkCount + 1;
+		vector<vector<Match>> found(chunkCount);
+		auto scanChunk = [&](size_t chunk) {
+			Regex::Matcher matcher(*pattern);
+			string scratch;
+			size_t caps[2 * Regex::MAX_GROUPS];
+			size_t last = min(lineCount, (chunk + 1) * chunkLines);
+			for (size_t line = chunk * chunkLines; line < last; ++line) {
+				string_view view = text.lineView(line, scratch);
+				if (!matcher.contains(view)) continue;
+				for (size_t from = 0; from <= view.size() && matcher.find(view, from, caps); from = caps[0] + 1) {
+					found[chunk].push_back(Match{ line, caps[0] });
+				}
+			}
+			};
+		if (parallel) {
+			ThreadPool::shared().parallelFor(chunkCount, scanChunk);
+		}
+		else {
+			for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+				scanChunk(chunk);
+			}
+		}
+		for (vector<Match>& part : found) {
+			matches.insert(matches.end(), part.begin(), part.end());
+		}
+	}
+};
+
+// Integer encodings used by the files kept next to a document: varints of
+// seven bits per byte, and fixed eight-byte little-endian words.
+void putVarint(string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out += static_cast<char>(value | 0x80);
+		value >>= 7;
+	}
+	out += static_cast<char>(value);
+}
+
+void putFixed(string& out, uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+		out += static_cast<char>(value >> (8 * i));
+	}
+}
+
+bool getVarint(const char*& p, const char* end, uint64_t& value) {
+	value = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char byte = *p++;
+		value |= uint64_t(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+uint64_t getFixed(const char* p) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; --i) {
+		value = value << 8 | static_cast<unsigned char>(p[i]);
+	}
+	return value;
+}
+
+// Undo history kept as a log of edits. A step holds the operations of one
+// normal-mode command, or of one stay in insert mode, each with the bytes it
+// removed and inserted, so it can be replayed in either direction. Typing and
+// repeated deletes coalesce into a single operation. When the log outgrows
+// its memory budget the oldest steps are dropped.
+//
+// The history also survives the session in a sidecar file next to the text
+// (see FileManager::undoFileName). It is a log of stack operations: a step
+// pushed, a step popped (undone and then replaced), and a marker for each
+// save that holds the hash of the saved text. Saves append only what changed
+// since the previous one. The file is not read when a document is loaded;
+// only once undo runs out of steps is it replayed up to the last save of the
+// text as it is now, and those steps become the older history.
+class UndoHistory {
+public:
+	static constexpr size_t DEFAULT_LIMIT = 64 << 20;
+
+	struct Cursor {
+		size_t line;
+		size_t column;
+	};
+
+private:
+	struct Operation {
+		size_t offset;
+		string removed;
+		string inserted;
+		// Inserted text held by a register too, in place of `inserted`; it
+		// is not copied, and is never extended by coalescing
+		shared_ptr<const string> shared;
+	};
+	static const string& insertedBy(const Operation& operation) {
+		return operation.shared ? *operation.shared : operation.inserted;
+	}
+	struct Step {
+		vector<Operation> operations;
+		// Operations that do not overlap, in document order, with offsets
+		// into the text as it was before the step (from PieceTable::splice)
+		bool batch;
+		Cursor before;
+		Cursor after;
+	};
+
+	deque<Step> undoSteps;
+	vector<Step> redoSteps;
+	bool open;          // The newest undo step still takes operations
+	size_t bytes;       // Held by both lists
+	size_t limit;
+
+	// The sidecar's stack is `hidden` steps no longer in memory, then the
+	// first `synced` entries of undoSteps, then `sidecarDepth - hidden -
+	// synced` steps that have since been undone here.
+	string sidecar;
+	bool sidecarKnown;      // The counts below describe the file
+	bool sidecarRead;       // It was replayed (or found useless) already
+	bool rewrite;           // The chain broke; the next save starts over
+	size_t sidecarDepth;
+	size_t hidden;
+	size_t synced;
+
+	static constexpr char MAGIC[9] = "VEUNDO02";
+	static constexpr size_t SAVE_RECORD = 25;   // 'S', hash, length, depth
+	enum Record : char { PUSH = 'P', POP = 'U', SAVE = 'S' };
+
+	// Shared text is left out: the register it came from holds it as well
+	static size_t sizeOf(const Operation& operation) {
+		return sizeof(Operation) + operation.removed.size() + operation.inserted.size();
+	}
+	static size_t sizeOf(const Step& step) {
+		size_t total = sizeof(Step);
+		for (const Operation& operation : step.operations) {
+			total += sizeOf(operation);
+		}
+		return total;
+	}
+
+	Step& openStep(const Cursor& cursor) {
+		if (!open || undoSteps.back().batch) {
+			seal(cursor);
+			for (const Step& step : redoSteps) {
+				bytes -= sizeOf(step);
+			}
+			redoSteps.clear();
+			undoSteps.push_back(Step{ {}, false, cursor, cursor });
+			bytes += sizeof(Step);
+			open = true;
+		}
+		return undoSteps.back();
+	}
+	void push(Step& step, Operation&& operation) {
+		bytes += sizeOf(operation);
+		step.operations.push_back(move(operation));
+		enforceLimit();
+	}
+	void enforceLimit() {
+		while (bytes > limit && !undoSteps.empty()) {
+			bytes -= sizeOf(undoSteps.front());
+			undoSteps.pop_front();
+			if (undoSteps.empty()) open = false;
+			if (synced > 0) {
+				synced--;
+				hidden++;
+			}
+			else {
+				rewrite = true;     // A step the file never saw is gone
+			}
+		}
+	}
+	void popped() {
+		synced = min(synced, undoSteps.size());
+	}
+
+	static void putString(string& out, const string& text) {
+		putVarint(out, text.size());
+		out += text;
+	}
+	static bool getString(const char*& p, const char* end, string& text) {
+		uint64_t length;
+		if (!getVarint(p, end, length) || length > static_cast<uint64_t>(end - p)) return false;
+		text.assign(p, length);
+		p += length;
+		return true;
+	}
+
+	static void encode(const Step& step, string& out) {
+		out += PUSH;
+		putVarint(out, step.batch);
+		putVarint(out, step.before.line);
+		putVarint(out, step.before.column);
+		putVarint(out, step.after.line);
+		putVarint(out, step.after.column);
+		putVarint(out, step.operations.size());
+		for (const Operation& operation : step.operations) {
+			putVarint(out, operation.offset);
+			putString(out, operation.removed);
+			putString(out, insertedBy(operation));
+		}
+	}
+	static bool decode(const char*& p, const char* end, Step& step) {
+		uint64_t batch, count;
+		uint64_t fields[4];
+		if (!getVarint(p, end, batch)) return false;
+		for (uint64_t& field : fields) {
+			if (!getVarint(p, end, field)) return false;
+		}
+		if (!getVarint(p, end, count)) return false;
+		step.batch = batch != 0;
+		step.before = Cursor{ fields[0], fields[1] };
+		step.after = Cursor{ fields[2], fields[3] };
+		step.operations.clear();
+		for (uint64_t i = 0; i < count; ++i) {
+			Operation operation;
+			uint64_t offset;
+			if (!getVarint(p, end, offset) || !getString(p, end, operation.removed) || !getString(p, end, operation.inserted)) {
+				return false;
+			}
+			operation.offset = offset;
+			step.operations.push_back(move(operation));
+		}
+		return true;
+	}
+
+	// Reads the save marker the sidecar ends with
+	bool readLastSave(uint64_t& hash, uint64_t& length, uint64_t& depth) const {
+		ifstream in(sidecar, ios::binary);
+		if (!in) return false;
+		char magic[8];
+		char record[SAVE_RECORD];
+		if (!in.read(magic, 8) || memcmp(magic, MAGIC, 8) != 0) return false;
+		in.seekg(-static_cast<streamoff>(SAVE_RECORD), ios::end);
+		if (!in.read(record, SAVE_RECORD) || record[0] != SAVE) return false;
+		hash = getFixed(record + 1);
+		length = getFixed(record + 9);
+		depth = getFixed(record + 17);
+		return true;
+	}
+
+	// Replays the sidecar and takes the stack as of the last save of `text`
+	// as the older history. Only called once the undo list is empty.
+	void readSidecar(const PieceTable& text) {
+		sidecarRead = true;
+		ifstream in(sidecar, ios::binary);
+		if (!in) return;
+		string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		if (data.size() < 8 || data.compare(0, 8, MAGIC) != 0) return;
+
+		uint64_t wanted = text.hash();
+		vector<Step> stack;
+		vector<Step> found;
+		bool matched = false;
+		bool matchedLast = false;
+		const char* p = data.data() + 8;
+		const char* end = data.data() + data.size();
+		while (p < end) {
+			char type = *p++;
+			if (type == PUSH) {
+				Step step;
+				if (!decode(p, end, step)) return;
+				stack.push_back(move(step));
+			}
+			else if (type == POP && !stack.empty()) {
+				stack.pop_back();
+			}
+			else if (type == SAVE && end - p >= static_cast<ptrdiff_t>(SAVE_RECORD - 1)) {
+				bool same = getFixed(p) == wanted && getFixed(p + 8) == text.length();
+				p += SAVE_RECORD - 1;
+				if (same) {
+					found = stack;
+					matched = true;
+				}
+				matchedLast = same;
+			}
+			else {
+				return;     // Damaged; ignore the rest
+			}
+		}
+		if (!matched) return;
+
+		// Keep the newest steps that fit in the budget
+		size_t keep = 0;
+		size_t total = bytes;
+		while (keep < found.size() && total + sizeOf(found[found.size() - 1 - keep]) <= limit) {
+			total += sizeOf(found[found.size() - 1 - keep]);
+			keep++;
+		}
+		for (size_t i = found.size() - keep; i < found.size(); ++i) {
+			undoSteps.push_back(move(found[i]));
+		}
+		bytes = total;
+		sidecarKnown = true;
+		if (matchedLast) {
+			sidecarDepth = stack.size();
+			hidden = found.size() - keep;
+			synced = keep;
+		}
+		else {
+			rewrite = true;
+		}
+	}
+
+public:
+	UndoHistory() : open(false), bytes(0), limit(DEFAULT_LIMIT), sidecarKnown(false), sidecarRead(true),
+		rewrite(false), sidecarDepth(0), hidden(0), synced(0) {}
+
+	// Starts over for a newly loaded document whose history, if any, is in
+	// the sidecar file `path`
+	void clear(const string& path = "") {
+		undoSteps.clear();
+		redoSteps.clear();
+		open = false;
+		bytes = 0;
+		sidecar = path;
+		sidecarKnown = false;
+		sidecarRead = path.empty();
+		rewrite = false;
+		sidecarDepth = hidden = synced = 0;
+	}
+	// Budget in bytes for the text kept by the history
+	void setMemoryLimit(size_t newLimit) {
+		limit = newLimit;
+		enforceLimit();
+	}
+	size_t memoryLimit() const {
+		return limit;
+	}
+	size_t memoryUsage() const {
+		return bytes;
+	}
+
+	// Ends the current step; `cursor` is where redo will leave the cursor.
+	void seal(const Cursor& cursor) {
+		if (!open) return;
+		Step& step = undoSteps.back();
+		step.after = cursor;
+		// Coalescing may have left slack behind
+		for (Operation& operation : step.operations) {
+			operation.inserted.shrink_to_fit();
+			operation.removed.shrink_to_fit();
+		}
+		open = false;
+	}
+
+	void recordInsert(size_t offset, const char* data, size_t count, const Cursor& cursor) {
+		Step& step = openStep(cursor);
+		if (!step.operations.empty()) {
+			Operation& last = step.operations.back();
+			if (!last.shared && offset == last.offset + last.inserted.size()) {
+				// Typing on after the previous insertion
+				last.inserted.append(data, count);
+				bytes += count;
+				enforceLimit();
+				return;
+			}
+		}
+		push(step, Operation{ offset, string(), string(data, count), nullptr });
+	}
+	// Records PieceTable::insertShared(offset, text)
+	void recordInsertShared(size_t offset, const shared_ptr<const string>& text, const Cursor& cursor) {
+		push(openStep(cursor), Operation{ offset, string(), string(), text });
+	}
+
+	void recordErase(size_t offset, string&& removed, const Cursor& cursor) {
+		Step& step = openStep(cursor);
+		if (!step.operations.empty()) {
+			Operation& last = step.operations.back();
+			size_t end = offset + removed.size();
+			size_t lastEnd = last.offset + last.inserted.size();
+			if (!last.shared && offset >= last.offset && end == lastEnd) {
+				// Backspace over text typed in this step
+				last.inserted.resize(offset - last.offset);
+				bytes -= removed.size();
+				return;
+			}
+			if (insertedBy(last).empty() && offset == last.offset) {
+				// x repeated in place
+				last.removed += removed;
+				bytes += removed.size();
+				enforceLimit();
+				return;
+			}
+			if (insertedBy(last).empty() && end == last.offset) {
+				// Backspace over older text
+				bytes += removed.size();
+				last.removed.insert(0, removed);
+				last.offset = offset;
+				enforceLimit();
+				return;
+			}
+		}
+		push(step, Operation{ offset, move(removed), string(), nullptr });
+	}
+
+	// Records PieceTable::splice(splices) as a step of its own; removed[i] is
+	// the text splices[i] replaces.
+	void recordSplices(const vector<PieceTable::Splice>& splices, vector<string>&& removed, const Cursor& cursor) {
+		seal(cursor);
+		Step& step = openStep(cursor);
+		step.batch = true;
+		step.operations.reserve(splices.size());
+		for (size_t i = 0; i < splices.size(); ++i) {
+			bytes += sizeof(Operation) + removed[i].size() + splices[i].text.size();
+			step.operations.push_back(Operation{ splices[i].offset, move(removed[i]), splices[i].text, nullptr });
+		}
+		enforceLimit();
+	}
+
+	// Appends to the sidecar `path` what changed since the last save of
+	// `text`, which was just saved. The hashes come from the blocks of the
+	// loaded text (see PieceTable::hash), so this does not read the text.
+	bool save(const string& path, const PieceTable& text, const Cursor& cursor) {
+		seal(cursor);
+		if (path != sidecar) {
+			sidecar = path;
+			sidecarKnown = false;
+			sidecarRead = true;     // The old file's history does not apply
+		}
+		if (!sidecarKnown) {
+			// Continue the file only if it ended with the text we started from
+			uint64_t hash, length, depth;
+			if (!rewrite && readLastSave(hash, length, depth) && hash == text.loadedHash() && length == text.loadedText().size()) {
+				sidecarDepth = depth;
+				hidden = depth;
+			}
+			else {
+				rewrite = true;
+			}
+			sidecarKnown = true;
+		}
+
+		string out;
+		if (rewrite) {
+			out = MAGIC;
+			hidden = 0;
+			synced = 0;
+			sidecarDepth = 0;
+		}
+		for (size_t i = hidden + synced; i < sidecarDepth; ++i) {
+			out += POP;
+		}
+		for (size_t i = synced; i < undoSteps.size(); ++i) {
+			encode(undoSteps[i], out);
+		}
+		sidecarDepth = hidden + undoSteps.size();
+		synced = undoSteps.size();
+		out += SAVE;
+		putFixed(out, text.hash());
+		putFixed(out, text.length());
+		putFixed(out, sidecarDepth);
+
+		ofstream file(path, ios::binary | (rewrite ? ios::trunc : ios::app));
+		rewrite = false;
+		if (!file || !file.write(out.data(), out.size())) {
+			rewrite = true;
+			return false;
+		}
+		return true;
+	}
+
+	// Reverts the newest step; `cursor` is set to where it was before it.
+	bool undo(PieceTable& text, Cursor& cursor) {
+		seal(cursor);
+		if (undoSteps.empty() && !sidecarRead) {
+			readSidecar(text);
+		}
+		if (undoSteps.empty()) return false;
+		Step step = move(undoSteps.back());
+		undoSteps.pop_back();
+		popped();
+		if (step.batch) {
+			vector<PieceTable::Splice> splices;
+			splices.reserve(step.operations.size());
+			size_t shift = 0;   // Growth of the text before the current operation
+			for (const Operation& operation : step.operations) {
+				splices.push_back(PieceTable::Splice{ operation.offset + shift, insertedBy(operation).size(), operation.removed });
+				shift += insertedBy(operation).size() - operation.removed.size();
+			}
+			text.splice(splices);
+		}
+		else {
+			for (size_t i = step.operations.size(); i-- > 0;) {
+				const Operation& operation = step.operations[i];
+				text.erase(operation.offset, insertedBy(operation).size());
+				text.insert(operation.offset, operation.removed);
+			}
+		}
+		cursor = step.before;
+		redoSteps.push_back(move(step));
+		return true;
+	}
+
+	// Applies the most recently undone step again.
+	bool redo(PieceTable& text, Cursor& cursor) {
+		seal(cursor);
+		if (redoSteps.empty()) return false;
+		Step step = move(redoSteps.back());
+		redoSteps.pop_back();
+		if (step.batch) {
+			vector<PieceTable::Splice> splices;
+			splices.reserve(step.operations.size());
+			for (const Operation& operation : step.operations) {
+				splices.push_back(PieceTable::Splice{ operation.offset, operation.removed.size(), insertedBy(operation) });
+			}
+			text.splice(splices);
+		}
+		else {
+			for (const Operation& operation : step.operations) {
+				text.erase(operation.offset, operation.removed.size());
+				if (operation.shared) {
+					text.insertShared(operation.offset, operation.shared);
+				}
+				else {
+					text.insert(operation.offset, operation.inserted);
+				}
+			}
+		}
+		cursor = step.after;
+		undoSteps.push_back(move(step));
+		return true;
+	}
+};
+
+// Crash-recovery log of the edits made since the file was last loaded or
+// saved: the swap file (see FileManager::swapFileName). Edits are encoded in
+// memory as they happen. A writer thread appends them to the file and syncs
+// it every SYNC_INTERVAL at most, so a crash loses at most that much work and
+// the cost grows with the edits, not with the size of the file. It starts
+// with the identity on disk of the file the edits apply to (see
+// FileManager::diskIdentity) and the length of its text, so starting a log
+// reads nothing of the file.
+class Journal {
+public:
+	struct Edit {
+		size_t offset;
+		size_t removed;
+		string inserted;
+	};
+
+private:
+	static constexpr char MAGIC[9] = "VESWAP02";
+	static constexpr size_t HEADER = 24;            // Magic, identity and length
+	static constexpr chrono::milliseconds SYNC_INTERVAL{ 500 };
+	static constexpr size_t FLUSH_BYTES = 1 << 20;  // Wakes the writer early
+	enum Record : char { INSERT = 'I', ERASE = 'E' };
+
+	string path;
+	string pending;         // Encoded but not yet written
+	bool running;
+	bool stopping;
+	atomic<bool> failed;
+	mutex lock;
+	condition_variable wake;
+	thread writer;
+#if defined(linux) || defined(APPLE)
+	int fd;
+#else
+	ofstream file;
+#endif
+
+	bool openFile() {
+#if defined(linux) || defined(APPLE)
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		return fd >= 0;
+#else
+		file.open(path, ios::binary | ios::trunc);
+		return file.is_open();
+#endif
+	}
+	bool append(const string& data) {
+#if defined(linux) || defined(APPLE)
+		size_t done = 0;
+		while (done < data.size()) {
+			ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			done += n;
+		}
+#if defined(APPLE)
+		return fsync(fd) == 0;
+#else
+		return fdatasync(fd) == 0;
+#endif
+#else
+		file.write(data.data(), data.size());
+		return static_cast<bool>(file.flush());
+#endif
+	}
+	void closeFile() {
+#if defined(linux) || defined(APPLE)
+		close(fd);
+#else
+		file.close();
+#endif
+	}
+
+	// Writes whatever piled up once per interval until stopped
+	void run() {
+		string batch;
+		unique_lock<mutex> guard(lock);
+		while (true) {
+			wake.wait_for(guard, SYNC_INTERVAL, [this] { return stopping || pending.size() >= FLUSH_BYTES; });
+			batch.swap(pending);
+			bool last = stopping;
+			guard.unlock();
+			if (!batch.empty() && !failed && !append(batch)) {
+				failed = true;
+			}
+			batch.clear();
+			guard.lock();
+			if (last) return;
+		}
+	}
+
+public:
+	Journal() : running(false), stopping(false), failed(false) {}
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	~Journal() {
+		stop();
+	}
+
+	bool active() const {
+		return running;
+	}
+	// Set when a write or sync failed; later edits are not logged
+	bool hasFailed() const {
+		return failed;
+	}
+
+	// Starts a new log in `file` for edits of the file with the given identity
+	bool start(const string& file, uint64_t identity, uint64_t length) {
+		stop();
+		path = file;
+		if (!openFile()) {
+			failed = true;
+			return false;
+		}
+		pending.assign(MAGIC, 8);
+		putFixed(pending, identity);
+		putFixed(pending, length);
+		failed = false;
+		stopping = false;
+		running = true;
+		writer = thread([this] { run(); });
+		return true;
+	}
+
+	void record(size_t offset, size_t removed, const char* inserted, size_t count) {
+		if (!running || failed) return;
+		bool full;
+		{
+			lock_guard<mutex> guard(lock);
+			if (removed > 0) {
+				pending += ERASE;
+				putVarint(pending, offset);
+				putVarint(pending, removed);
+			}
+			if (count > 0) {
+				pending += INSERT;
+				putVarint(pending, offset);
+				putVarint(pending, count);
+				pending.append(inserted, count);
+			}
+			full = pending.size() >= FLUSH_BYTES;
+		}
+		if (full) {
+			wake.notify_one();
+		}
+	}
+
+	// Writes out what is pending and closes the log
+	void stop() {
+		if (!running) return;
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		writer.join();
+		closeFile();
+		running = false;
+	}
+	// Closes the log and deletes it, once its edits are saved or abandoned
+	void discard() {
+		stop();
+		if (!path.empty()) {
+			remove(path.c_str());
+			path.clear();
+		}
+		failed = false;
+	}
+
+	// Reads the log in `file`: the identity and length of the file it applies
+	// to and the edits, up to the first damaged or partly written record.
+	static bool read(const string& file, uint64_t& identity, uint64_t& length, vector<Edit>& edits) {
+		ifstream in(file, ios::binary);
+		if (!in) return false;
+		string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		if (data.size() < HEADER || data.compare(0, 8, MAGIC) != 0) return false;
+		identity = getFixed(data.data() + 8);
+		length = getFixed(data.data() + 16);
+		const char* p = data.data() + HEADER;
+		const char* end = data.data() + data.size();
+		edits.clear();
+		while (p < end) {
+			char type = *p++;
+			uint64_t offset, count;
+			if (!getVarint(p, end, offset) || !getVarint(p, end, count)) break;
+			if (type == ERASE) {
+				edits.push_back(Edit{ offset, count, string() });
+			}
+			else if (type == INSERT && count <= static_cast<uint64_t>(end - p)) {
+				edits.push_back(Edit{ offset, 0, string(p, count) });
+				p += count;
+			}
+			else {
+				break;
+			}
+		}
+		return true;
+	}
+};
+
+class FileManager {
+private:
+	string currentFileName;
+	bool modified;
+#if defined(linux) || defined(APPLE)
+	struct stat diskState;      // The file as we last loaded or saved it
+	bool haveDiskState;
+
+	void rememberDiskState(const string& filename) {
+		haveDiskState = stat(filename.c_str(), &diskState) == 0;
+	}
+	bool unchangedOnDisk(const string& filename) const {
+		struct stat info;
+		return haveDiskState && stat(filename.c_str(), &info) == 0
+			&& info.st_dev == diskState.st_dev && info.st_ino == diskState.st_ino
+			&& info.st_size == diskState.st_size && info.st_mtime == diskState.st_mtime;
+	}
+	static long modifiedNanoseconds(const struct stat& info) {
+#if defined(APPLE)
+		return info.st_mtimespec.tv_nsec;
+#else
+		return info.st_mtim.tv_nsec;
+#endif
+	}
+
+	// Gathers spans into iovec batches so a save takes a handful of writev()
+	// calls instead of one stream insertion per character.
+	class SpanWriter {
+		static constexpr size_t BATCH = 1024;
+		int fd;
+		vector<iovec> pending;
+
+	public:
+		size_t written;
+
+		SpanWriter(int fd) : fd(fd), written(0) {}
+
+		bool add(const char* data, size_t length) {
+			if (length == 0) return true;
+			pending.push_back(iovec{ const_cast<char*>(data), length });
+			return pending.size() < BATCH || flush();
+		}
+
+		bool flush() {
+			size_t first = 0;
+			while (first < pending.size()) {
+				ssize_t n = writev(fd, &pending[first], static_cast<int>(min(BATCH, pending.size() - first)));
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					return false;
+				}
+				written += n;
+				// Skip what went out, trimming a partially written span
+				while (n > 0 && static_cast<size_t>(n) >= pending[first].iov_len) {
+					n -= pending[first].iov_len;
+					first++;
+				}
+				if (n > 0) {
+					pending[first].iov_base = static_cast<char*>(pending[first].iov_base) + n;
+					pending[first].iov_len -= n;
+				}
+			}
+			pending.clear();
+			return true;
+		}
+
+		// Lets the kernel copy a range of the old file; on file systems with
+		// shared extents the unchanged text is not rewritten at all.
+		bool copyFrom(int source, size_t offset, size_t length, size_t& copied) {
+#if defined(linux)
+			if (!flush()) return false;
+			loff_t from = offset;
+			while (length > 0) {
+				ssize_t n = copy_file_range(source, &from, fd, nullptr, length, 0);
+				if (n <= 0) {
+					if (n < 0 && errno == EINTR) continue;
+					return false;
+				}
+				length -= n;
+				written += n;
+				copied += n;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+	};
+
+	// Writes the whole text and its final newline to `out`. Large untouched
+	// stretches of the file mapped as `source` are copied in the kernel.
+	bool writeText(SpanWriter& out, const PieceTable& text, int source) {
+		const size_t COPY_THRESHOLD = 64 << 10;
+		bool ok = true;
+		text.forEachPiece([&](const PieceTable::Piece& piece, const char* data) {
+			if (!ok) return;
+			if (source >= 0 && piece.source == PieceTable::ORIGINAL && piece.length >= COPY_THRESHOLD) {
+				size_t copied = 0;
+				if (out.copyFrom(source, piece.start, piece.length, copied)) {
+					lastSave.copiedBytes += copied;
+					return;
+				}
+				source = -1;    // Not supported here; write the rest ourselves
+				data += copied;
+				ok = out.add(data, piece.length - copied);
+				return;
+			}
+			ok = out.add(data, piece.length);
+			});
+		return ok && out.add("\n", 1) && out.flush();
+	}
+
+	// Overwrites the file itself, keeping its inode and with it hard links,
+	// owner and permissions. A crash midway leaves it partly written, so
+	// this is only for files a rename would not do right by.
+	bool writeInPlace(const string& target, PieceTable& text) {
+		int fd = open(target.c_str(), O_WRONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		// The text may still be reading the old contents from this very file
+		struct stat info, mappedInfo;
+		int source = text.originalFd();
+		if (source >= 0 && fstat(fd, &info) == 0 && fstat(source, &mappedInfo) == 0
+			&& info.st_dev == mappedInfo.st_dev && info.st_ino == mappedInfo.st_ino) {
+			if (!text.keepOriginalPrivate()) {
+				close(fd);
+				return false;
+			}
+			source = -1;
+		}
+		SpanWriter out(fd);
+		bool ok = writeText(out, text, source);
+		ok = ok && ftruncate(fd, out.written) == 0 && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok;
+		if (ok) {
+			lastSave.bytes = out.written;
+		}
+		return ok;
+	}
+
+	// Writes the text next to the target, syncs it and renames it over the
+	// target, so a crash leaves either the old file or the new one. Files
+	// with more hard links, reached through a symlink, whose owner cannot be
+	// kept, or in a directory we cannot create files in are written in place.
+	bool writeAtomically(const string& filename, PieceTable& text) {
+		struct stat link;
+		bool symlinked = lstat(filename.c_str(), &link) == 0 && S_ISLNK(link.st_mode);
+		string target = filename;
+		char resolved[PATH_MAX];
+		if (realpath(filename.c_str(), resolved)) {
+			target = resolved;
+		}
+		// A new file gets 0666 less the umask, applied by the kernel in
+		// open(); umask() itself is process-wide and would race with saves
+		// on other threads.
+		struct stat info;
+		bool exists = stat(target.c_str(), &info) == 0;
+		if (exists && (symlinked || info.st_nlink > 1)) {
+			return writeInPlace(target, text);
+		}
+		static atomic<unsigned> tempCount(0);
+		string tempName;
+		int fd;
+		do {
+			tempName = target + "." + to_string(getpid()) + "." + to_string(tempCount++);
+			fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		} while (fd < 0 && errno == EEXIST);
+		if (fd < 0) {
+			return exists && writeInPlace(target, text);
+		}
+		if (exists) {
+			if (fchown(fd, info.st_uid, info.st_gid) != 0) {
+				close(fd);
+				unlink(tempName.c_str());
+				return writeInPlace(target, text);
+			}
+			fchmod(fd, info.st_mode & 07777);   // After fchown, which may clear set-id bits
+		}
+
+		SpanWriter out(fd);
+		bool ok = writeText(out, text, text.originalFd());
+		ok = ok && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok;
+		if (!ok || rename(tempName.c_str(), target.c_str()) != 0) {
+			unlink(tempName.c_str());
+			return false;
+		}
+		lastSave.bytes = out.written;
+
+		// Make the rename itself durable
+		size_t slash = target.rfind('/');
+		string directory = slash == string::npos ? "." : (slash == 0 ? "/" : target.substr(0, slash));
+		int dirFd = open(directory.c_str(), O_RDONLY);
+		if (dirFd >= 0) {
+			fsync(dirFd);
+			close(dirFd);
+		}
+		return true;
+	}
+#endif
+
+public:
+	// Files at least this big are memory-mapped instead of read
+	static constexpr streamoff LARGE_FILE_BYTES = 16 << 20;
+
+	struct SaveReport {
+		size_t bytes;           // Size of the saved file
+		size_t copiedBytes;     // Part of it copied by the kernel from the old file
+		double seconds;
+		bool skipped;           // Nothing changed, so nothing was written
+	};
+	SaveReport lastSave;
+
+#if defined(linux) || defined(APPLE)
+	FileManager() : currentFileName(""), modified(false), haveDiskState(false), lastSave{ 0, 0, 0.0, false } {}
+#else
+	FileManager() : currentFileName(""), modified(false), lastSave{ 0, 0, 0.0, false } {}
+#endif
+
+	// Reads a whole file into `content`, for inserting it into the text
+	static bool readFile(const string& filename, string& content) {
+		ifstream file(filename, ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		file.seekg(0, ios::end);
+		streamoff size = file.tellg();
+		file.seekg(0, ios::beg);
+		content.assign(size > 0 ? static_cast<size_t>(size) : 0, '\0');
+		return size <= 0 || static_cast<bool>(file.read(&content[0], size));
+	}
+
+	bool loadFile(const string& filename, PieceTable& text) {
+		ifstream file(filename, ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		file.seekg(0, ios::end);
+		streamoff size = file.tellg();
+		file.seekg(0, ios::beg);
+		if (size >= LARGE_FILE_BYTES && text.loadMapped(filename)) {
+			currentFileName = filename;
+			modified = false;
+#if defined(linux) || defined(APPLE)
+			rememberDiskState(filename);
+#endif
+			return true;
+		}
+
+		// Read the whole file in one go; the piece table keeps it as-is
+		string content(size > 0 ? static_cast<size_t>(size) : 0, '\0');
+		if (size > 0 && !file.read(&content[0], size)) {
+			return false;
+		}
+		file.close();
+		text.load(move(content));
+		currentFileName = filename;
+		modified = false;
+#if defined(linux) || defined(APPLE)
+		rememberDiskState(filename);
+#endif
+		return true;
+	}
+
+	bool saveFile(const string& filename, PieceTable& text) {
+		auto started = chrono::steady_clock::now();
+		lastSave = SaveReport{ 0, 0, 0.0, false };
+#if defined(linux) || defined(APPLE)
+		if (!modified && filename == currentFileName && unchangedOnDisk(filename)) {
+			lastSave.skipped = true;
+			return true;
+		}
+		if (!writeAtomically(filename, text)) {
+			return false;
+		}
+		rememberDiskState(filename);
+#else
+		ofstream file(filename, ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+
+		text.forEachSpan([&](const char* data, size_t length) {
+			file.write(data, length);
+			lastSave.bytes += length;
+			});
+		file << '\n';
+		file.close();
+		lastSave.bytes++;
+#endif
+		lastSave.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+		currentFileName = filename;
+		modified = false;
+		return true;
+	}
+
+	void markAsModified() {
+		modified = true;
+	}
+	bool hasUnsavedChanges() {
+		return modified;
+	}
+	string getCurrentFileName() {
+		return currentFileName;
+	}
+
+	// Hidden file next to `filename` named after it with `suffix`
+	static string hiddenFileName(const string& filename, const string& suffix) {
+		size_t slash = filename.find_last_of("/\\");
+		if (slash == string::npos) {
+			return "." + filename + suffix;
+		}
+		return filename.substr(0, slash + 1) + "." + filename.substr(slash + 1) + suffix;
+	}
+	// Keeps the undo history of `filename`
+	static string undoFileName(const string& filename) {
+		return hiddenFileName(filename, ".un~");
+	}
+	// Keeps the unsaved edits of `filename` until it is saved
+	static string swapFileName(const string& filename) {
+		return hiddenFileName(filename, ".swp");
+	}
+
+	// The file as last loaded or saved, told apart from any other version of
+	// it by device, inode, size and modification time: a stand-in for a
+	// hash of its contents that costs nothing to take. 0 when unknown.
+	uint64_t diskIdentity() const {
+#if defined(linux) || defined(APPLE)
+		if (!haveDiskState) return 0;
+		uint64_t fields[] = { uint64_t(diskState.st_dev), uint64_t(diskState.st_ino), uint64_t(diskState.st_size),
+			uint64_t(diskState.st_mtime), uint64_t(modifiedNanoseconds(diskState)) };
+		return ContentHash::of(string_view(reinterpret_cast<const char*>(fields), sizeof fields));
+#else
+		return 0;
+#endif
+	}
+};
+
+// The terminal as last drawn. Frames are given as rows of text; a row that
+// changed is rewritten from its first differing column, and all the escape
+// sequences of a frame go out in a single write(), so the cost of a redraw
+// follows what changed on screen rather than the size of the document.
+class Screen {
+	size_t height;
+	size_t width;
+	vector<string> shown;   // Rows on the terminal now
+	bool valid;             // Nothing else wrote to the terminal since
+	bool attached;          // Following the terminal; see attach()
+#if defined(linux) || defined(APPLE)
+	static inline volatile sig_atomic_t resized = 0;
+	static void onResize(int) {
+		resized = 1;
+	}
+#endif
+
+	static void output(const string& data) {
+		cout.flush();
+#if defined(linux) || defined(APPLE)
+		size_t done = 0;
+		while (done < data.size()) {
+			ssize_t n = write(STDOUT_FILENO, data.data() + done, data.size() - done);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return;
+			}
+			done += n;
+		}
+#else
+		fwrite(data.data(), 1, data.size(), stdout);
+		fflush(stdout);
+#endif
+	}
+	static void moveTo(string& out, size_t row, size_t column) {
+		out += "\x1b[";
+		out += to_string(row + 1);
+		out += ';';
+		out += to_string(column + 1);
+		out += 'H';
+	}
+
+public:
+	// Second and later bytes of a UTF-8 character take no column
+	static bool continuation(char c) {
+		return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+	}
+
+	Screen() : height(24), width(80), valid(false), attached(false) {
+	}
+
+	// Starts following the terminal: its size, and SIGWINCH for changes to
+	// it. Done on the first frame, so a screen that never draws, as in
+	// scripted mode, leaves the terminal and signal handlers alone.
+	void attach() {
+		if (attached) return;
+		attached = true;
+#if defined(linux) || defined(APPLE)
+		struct sigaction action;
+		memset(&action, 0, sizeof action);
+		action.sa_handler = onResize;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGWINCH, &action, nullptr);
+#endif
+		querySize();
+	}
+
+	size_t rows() const {
+		return height;
+	}
+	size_t columns() const {
+		return width;
+	}
+	void resize(size_t rows, size_t columns) {
+		height = max<size_t>(rows, 4);
+		width = max<size_t>(columns, 20);
+		valid = false;
+	}
+	// Takes the size of the terminal; false when output is not a terminal
+	bool querySize() {
+#if defined(linux) || defined(APPLE)
+		struct winsize size;
+		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+			resize(size.ws_row, size.ws_col);
+			return true;
+		}
+#endif
+		return false;
+	}
+	// Picks up a new terminal size after SIGWINCH; called before each frame
+	void followResize() {
+		if (!attached) {
+			attach();
+			return;
+		}
+#if defined(linux) || defined(APPLE)
+		if (resized) {
+			resized = 0;
+			querySize();
+		}
+#endif
+	}
+	// The next frame repaints everything, as something else drew over it
+	void invalidate() {
+		valid = false;
+	}
+
+	// Columns taken by `text` on screen, with tabs expanded from `column`
+	static size_t widthOf(string_view text, size_t column = 0) {
+		size_t start = column;
+		for (char c : text) {
+			if (c == '\t') {
+				column += 8 - column % 8;
+			}
+			else if (!continuation(c)) {
+				column++;
+			}
+		}
+		return column - start;
+	}
+	// Appends `text` to `row` as it appears on screen, cut at the right
+	// edge. Tab stops count from where the text starts.
+	void appendCells(string& row, string_view text) const {
+		size_t origin = widthOf(row);
+		size_t column = origin;
+		for (size_t i = 0; i < text.size(); ++i) {
+			char c = text[i];
+			if (c == '\t') {
+				size_t next = column + 8 - (column - origin) % 8;
+				for (; column < next && column < width; ++column) {
+					row += ' ';
+				}
+				if (column >= width) return;
+				continue;
+			}
+			if (continuation(c)) {
+				row += c;
+				continue;
+			}
+			if (column >= width) return;
+			row += static_cast<unsigned char>(c) < 0x20 || c == 0x7F ? '?' : c;
+			column++;
+		}
+	}
+
+	// Draws `frame`, one string per row, and leaves the cursor at the given
+	// screen position.
+	void draw(const vector<string>& frame, size_t cursorRow, size_t cursorColumn) {
+		string out = "\x1b[?25l";     // Hide the cursor while drawing
+		if (!valid || shown.size() != frame.size()) {
+			out += "\x1b[H\x1b[2J";
+			shown.assign(frame.size(), string());
+			valid = true;
+		}
+		for (size_t i = 0; i < frame.size(); ++i) {
+			const string& row = frame[i];
+			const string& old = shown[i];
+			if (row == old) continue;
+			size_t same = 0;
+			size_t limit = min(row.size(), old.size());
+			while (same < limit && row[same] == old[same]) {
+				same++;
+			}
+			while (same > 0 && same < row.size() && continuation(row[same])) {
+				same--;     // Start on a whole character
+			}
+			moveTo(out, i, widthOf(string_view(row).substr(0, same)));
+			out.append(row, same, string::npos);
+			if (widthOf(row) < widthOf(old)) {
+				out += "\x1b[K";
+			}
+			shown[i] = row;
+		}
+		moveTo(out, cursorRow, min(cursorColumn, width - 1));
+		out += "\x1b[?25h";
+		output(out);
+	}
+
+	// Moves the cursor to the start of the empty `row` for output that is
+	// not part of a frame, such as a prompt; the next frame repaints all.
+	void release(size_t row) {
+		string out;
+		moveTo(out, row, 0);
+		out += "\x1b[K";
+		output(out);
+		valid = false;
+	}
+};
+
+// Where long lines wrap on screen. A line is cut into rows of at most
+// `width` columns, breaking between characters; the cuts of every line drawn
+// are cached until the line is edited or the width changes, and an edit
+// only renumbers the entries of the lines after it.
+class WrapLayout {
+	static constexpr size_t MAX_CACHED = 4096;  // Lines; enough for any screen
+	size_t width;
+	map<size_t, vector<size_t>> rowStarts;      // Line -> offset of each row
+
+public:
+	WrapLayout() : width(80) {}
+
+	void setWidth(size_t columns) {
+		if (columns != width) {
+			width = columns;
+			rowStarts.clear();
+		}
+	}
+	void clear() {
+		rowStarts.clear();
+	}
+
+	// Offsets in `line`, whose text is `text`, where its rows start. The
+	// first is always 0. Valid until the next call.
+	const vector<size_t>& rows(size_t line, string_view text) {
+		auto found = rowStarts.find(line);
+		if (found != rowStarts.end()) return found->second;
+		if (rowStarts.size() >= MAX_CACHED) {
+			rowStarts.clear();
+		}
+		vector<size_t> starts{ 0 };
+		size_t column = 0;
+		for (size_t i = 0; i < text.size(); ++i) {
+			char c = text[i];
+			if (Screen::continuation(c)) continue;
+			size_t cells = c == '\t' ? 8 - column % 8 : 1;
+			if (column > 0 && column + cells > width) {
+				starts.push_back(i);
+				column = 0;
+				cells = c == '\t' ? 8 : 1;
+			}
+			column += cells;
+		}
+		return rowStarts.emplace(line, move(starts)).first->second;
+	}
+	// Row of `line` that holds the character at `offset`
+	size_t rowOf(size_t line, string_view text, size_t offset) {
+		const vector<size_t>& starts = rows(line, text);
+		return upper_bound(starts.begin(), starts.end(), offset) - starts.begin() - 1;
+	}
+
+	// Follows an edit that replaced lines [line, line + removed] with
+	// [line, line + added]
+	void linesChanged(size_t line, size_t removed, size_t added) {
+		auto next = rowStarts.erase(rowStarts.lower_bound(line), rowStarts.upper_bound(line + removed));
+		if (removed == added) return;
+		map<size_t, vector<size_t>> moved;
+		while (next != rowStarts.end()) {
+			auto entry = rowStarts.extract(next++);
+			entry.key() = entry.key() - removed + added;
+			moved.insert(moved.end(), move(entry));
+		}
+		rowStarts.merge(moved);
+	}
+};
+
+// Lines kept by yank and delete for p and P: the unnamed register, "0 with
+// the last yank, "1 to "9 with the last deletes (newest first) and "a to
+// "z. Contents are immutable and shared, so one yank in several registers,
+// moving down the delete history, or pasting, never copies the text. Macros
+// recorded with q are kept in the same registers, so "ap puts macro a in
+// the text and @a replays a yanked line as keys.
+class Registers {
+public:
+	using Text = shared_ptr<const string>;
+	static constexpr char UNNAMED = '"';
+
+private:
+	Text unnamed;
+	Text numbered[10];
+	Text named[26];
+
+	// Stores in "a to "z, or appends for "A to "Z. False for other names.
+	bool storeNamed(char name, Text& text) {
+		if (name >= 'a' && name <= 'z') {
+			named[name - 'a'] = text;
+		}
+		else if (name >= 'A' && name <= 'Z') {
+			Text& kept = named[name - 'A'];
+			if (kept) {
+				text = make_shared<const string>(*kept + "\n" + *text);
+			}
+			kept = text;
+		}
+		else {
+			return false;
+		}
+		unnamed = text;
+		return true;
+	}
+
+public:
+	static bool isName(int c) {
+		return c == UNNAMED || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+	}
+
+	void yanked(char name, Text text) {
+		if (!storeNamed(name, text)) {
+			numbered[0] = text;
+			unnamed = move(text);
+		}
+	}
+	void deleted(char name, Text text) {
+		if (!storeNamed(name, text)) {
+			move_backward(numbered + 1, numbered + 9, numbered + 10);
+			numbered[1] = text;
+			unnamed = move(text);
+		}
+	}
+	// Keys recorded with q{name}, as Terminal::keysToText() gives them; "A
+	// to "Z append to the keys already there
+	void recorded(char name, Text keys) {
+		if (name >= '0' && name <= '9') {
+			numbered[name - '0'] = move(keys);
+		}
+		else if (name >= 'a' && name <= 'z') {
+			named[name - 'a'] = move(keys);
+		}
+		else if (name >= 'A' && name <= 'Z') {
+			Text& kept = named[name - 'A'];
+			kept = kept ? make_shared<const string>(*kept + *keys) : move(keys);
+		}
+	}
+	// Null when nothing was stored under `name`
+	Text get(char name) const {
+		if (name >= '0' && name <= '9') return numbered[name - '0'];
+		if (name >= 'a' && name <= 'z') return named[name - 'a'];
+		if (name >= 'A' && name <= 'Z') return named[name - 'A'];
+		return unnamed;
+	}
+};
+
+class TextEditor {
+	PieceTable text;
+	size_t current_line;
+	// Cursor sits on a character and text is inserted after it: cursorCol is the
+	// number of characters up to and including that character, so 0 means the
+	// insertion point is at the very start of the line.
+	size_t cursorCol;
+	bool insertMode;
+	shared_ptr<Registers> registers;    // Shared by every buffer of a session
+	EditorStatus status;
+	FileManager fileManager;
+	SearchEngine searchEngine;
+	UndoHistory history;
+	Journal journal;
+	Screen screen;
+	WrapLayout layout;
+	size_t topLine;         // First line on screen
+	size_t topRow;          // and its first row shown, when it wraps
+	size_t baseLength;      // Of the text the swap file's edits apply to
+	bool baseKnown;
+	bool failed;            // A command could not do its job; see takeFailure()
+	bool evicted;           // The text was dropped to be read again from its file
+	uint64_t evictedHash;   // and should then be this
+	size_t evictedLength;
+	bool sideFiles;         // See useSideFiles()
+	bool isWordCharacter(char c) {
+		if ((c >= 65 && c <= 90) || (c >= 97 && c <= 122)) {
+			return true;
+		}
+		return false;
+	}
+	bool isPunctuation(char c) {
+		if ((c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c == ' ')) {
+			return true;
+		}
+		return false;
+	}
+	// The cursor line as last looked up. Typing and deleting at the cursor
+	// update it in place; any other edit changes the text's version and so
+	// makes it stale, as does moving to another line.
+	struct LineInfo {
+		size_t line;
+		size_t version;     // Text version it was taken at
+		size_t start;
+		size_t length;
+	};
+	mutable LineInfo lineInfo;
+	const LineInfo& currentLine() const {
+		if (lineInfo.line != current_line || lineInfo.version != text.version()) {
+			lineInfo = LineInfo{ current_line, text.version(), text.lineStart(current_line), text.lineLength(current_line) };
+		}
+		return lineInfo;
+	}
+	// After an edit of `delta` characters inside the cursor line
+	void lineResized(const LineInfo& before, ptrdiff_t delta) {
+		lineInfo = before;
+		lineInfo.length += delta;
+		lineInfo.version = text.version();
+	}
+	size_t cursorOffset() const {
+		return currentLine().start + cursorCol;
+	}
+	// Cursor on the first character of the current line, as after moving to it
+	void cursorToLineStart() {
+		cursorCol = currentLine().length > 0 ? 1 : 0;
+	}
+	void clampCursor() {
+		if (current_line >= text.lineCount()) {
+			current_line = text.lineCount() - 1;
+		}
+		cursorCol = min(cursorCol, currentLine().length);
+	}
+	UndoHistory::Cursor cursor() const {
+		return UndoHistory::Cursor{ current_line, cursorCol };
+	}
+	// Last of the `count` lines starting at the cursor, or of as many as
+	// there are
+	size_t lastLineOf(size_t count) const {
+		return current_line + min(count, text.lineCount() - current_line) - 1;
+	}
+	static string linesText(size_t count) {
+		return to_string(count) + (count == 1 ? " line" : " lines");
+	}
+
+	// Text for insertBlock(): given, or the contents of a register, which
+	// the text and its undo history share instead of copying
+	struct Part {
+		string_view data;
+		Registers::Text shared;
+		Part(const char* data) : data(data) {}
+		Part(const string& data) : data(data) {}
+		Part(const Registers::Text& shared) : data(*shared), shared(shared) {}
+	};
+
+	// Puts `parts`, which may span lines, one after the other into the text
+	// at `offset` in one edit that is undone on its own. The cost follows
+	// their size. Returns where the cursor goes to stand just after them.
+	UndoHistory::Cursor insertBlock(size_t offset, initializer_list<Part> parts) {
+		history.seal(cursor());
+		size_t line = text.lineOf(offset);
+		size_t column = offset - text.lineStart(line);
+		for (const Part& part : parts) {
+			string_view data = part.data;
+			if (part.shared) {
+				insertShared(offset, part.shared);
+			}
+			else {
+				insertText(offset, data.data(), data.size());
+			}
+			offset += data.size();
+			size_t lastBreak = data.rfind('\n');
+			if (lastBreak == string_view::npos) {
+				column += data.size();
+			}
+			else {
+				line += count(data.begin(), data.end(), '\n');
+				column = data.size() - lastBreak - 1;
+			}
+		}
+		history.seal(UndoHistory::Cursor{ line, column });
+		markModified();
+		return UndoHistory::Cursor{ line, column };
+	}
+
+	// Every change to the text goes through these so it can be undone
+	void insertText(size_t offset, const char* data, size_t count) {
+		if (count == 0) return;
+		history.recordInsert(offset, data, count, cursor());
+		text.insert(offset, data, count);
+	}
+	void insertShared(size_t offset, const Registers::Text& shared) {
+		if (shared->empty()) return;
+		history.recordInsertShared(offset, shared, cursor());
+		text.insertShared(offset, shared);
+	}
+	void eraseText(size_t offset, size_t count) {
+		count = min(count, text.length() - min(offset, text.length()));
+		if (count == 0) return;
+		history.recordErase(offset, text.substr(offset, count), cursor());
+		text.erase(offset, count);
+	}
+
+	// Logs every change of the text in the swap file, which the first change
+	// after a load or save creates. That change also starts hashing the
+	// loaded text, for the undo file written by the save to come.
+	void journalEdit(size_t offset, size_t removed, const char* inserted, size_t count) {
+		if (!sideFiles) return;
+		if (!journal.active() && !journal.hasFailed()) {
+			text.prepareHash();
+			string filename = fileManager.getCurrentFileName();
+			if (filename.empty()) return;
+			if (!baseKnown) {
+				baseLength = text.loadedText().size();
+				baseKnown = true;
+			}
+			journal.start(FileManager::swapFileName(filename), fileManager.diskIdentity(), baseLength);
+		}
+		journal.record(offset, removed, inserted, count);
+		if (journal.hasFailed()) {
+			updateStatus("Cannot write the swap file; changes are kept in memory only");
+		}
+	}
+
+	// Replays the edits a session that ended without saving left in the swap
+	// file of `filename`, as one change that can be undone
+	void recoverSwapFile(const string& filename) {
+		string swap = FileManager::swapFileName(filename);
+		uint64_t identity, length;
+		vector<Journal::Edit> edits;
+		if (!Journal::read(swap, identity, length, edits)) return;
+		baseLength = text.loadedText().size();
+		baseKnown = true;
+		if (identity != fileManager.diskIdentity() || length != baseLength) {
+			updateStatus("Swap file " + swap + " is for another version of the file and will be replaced");
+			return;
+		}
+		size_t applied = 0;
+		for (const Journal::Edit& edit : edits) {
+			if (edit.offset > text.length()) break;
+			eraseText(edit.offset, edit.removed);
+			insertText(edit.offset, edit.inserted.data(), edit.inserted.size());
+			applied++;
+		}
+		history.seal(cursor());
+		if (applied == 0) {
+			remove(swap.c_str());
+			return;
+		}
+		clampCursor();
+		markModified();
+		updateStatus("Recovered " + to_string(applied) + " changes from " + swap + "; :w keeps them, u undoes them");
+	}
+
+public:
+	TextEditor() : current_line(0), cursorCol(0), insertMode(false), registers(make_shared<Registers>()), topLine(0), topRow(0), baseLength(0), baseKnown(false), failed(false), evicted(false), evictedHash(0), evictedLength(0), sideFiles(true), lineInfo{ 0, SIZE_MAX, 0, 0 } {
+		searchEngine.attach(text);
+		text.onLinesChanged = [this](size_t line, size_t removed, size_t added) {
+			searchEngine.linesChanged(line, removed, added);
+			layout.linesChanged(line, removed, added);
+			};
+		text.onTextChanged = [this](size_t offset, size_t removed, const char* inserted, size_t count) {
+			journalEdit(offset, removed, inserted, count);
+			};
+		updateStatus();
+	}
+	// Leaving normally, saved or not, means the swap file is not needed
+	~TextEditor() {
+		journal.discard();
+	}
+	void joinLines() {
+		if (current_line < text.lineCount() - 1) {
+			// Drop the line feed between the current line and the next one
+			eraseText(text.lineEnd(current_line), 1);
+			markModified();
+			updateStatus("Joined lines");
+		}
+		else {
+			failed = true;
+		}
+	}
+
+	// Shifts the `count` lines from the cursor down by a space, as one
+	// edit. Empty lines stay empty, and only a leading space is taken away.
+	void shiftLines(size_t count, bool increase) {
+		size_t first = current_line;
+		size_t last = lastLineOf(count);
+		vector<PieceTable::Splice> edits;
+		for (size_t line = first; line <= last; ++line) {
+			if (text.lineLength(line) == 0) continue;
+			size_t start = text.lineStart(line);
+			if (increase) {
+				edits.push_back(PieceTable::Splice{ start, 0, " " });
+			}
+			else if (text.charAt(start) == ' ') {
+				edits.push_back(PieceTable::Splice{ start, 1, "" });
+			}
+		}
+		if (!edits.empty()) {
+			applyEdits(edits);
+			markModified();
+		}
+		current_line = first;
+		cursorToLineStart();
+		updateStatus((increase ? "Indented " : "Unindented ") + linesText(last - first + 1));
+	}
+
+	void deleteLineNumber(size_t lineNum) {
+		if (lineNum < 1 || lineNum > text.lineCount()) {
+			fail("Invalid line number");
+			return;
+		}
+
+		// Adjust for 0-based index
+		lineNum--;
+
+		// Delete the specified line together with one of its line feeds
+		size_t start = text.lineStart(lineNum);
+		size_t end = text.lineEnd(lineNum);
+		if (lineNum + 1 < text.lineCount()) {
+			end++;
+		}
+		else if (lineNum > 0) {
+			start--;
+		}
+		eraseText(start, end - start);
+
+		if (current_line >= text.lineCount()) {
+			current_line = text.lineCount() - 1; // Adjust current line if needed
+		}
+		cursorToLineStart();
+		markModified();
+		updateStatus("Deleted line " + to_string(lineNum + 1));
+	}
+
+	// Deletes the `count` lines from the cursor down in one edit, keeping
+	// them in register `name` and the delete history
+	void deleteLines(size_t count, char name = Registers::UNNAMED) {
+		size_t first = current_line;
+		size_t last = lastLineOf(count);
+		size_t start = text.lineStart(first);
+		size_t end = text.lineEnd(last);
+		registers->deleted(name, make_shared<const string>(text.substr(start, end - start)));
+		// One of the line feeds around them goes too
+		if (last + 1 < text.lineCount()) {
+			end++;
+		}
+		else if (first > 0) {
+			start--;
+		}
+		eraseText(start, end - start);
+
+		if (current_line >= text.lineCount()) {
+			current_line = text.lineCount() - 1;
+		}
+		cursorToLineStart();
+		markModified();
+		updateStatus("Deleted " + linesText(last - first + 1));
+	}
+
+	// Copies the `count` lines from the cursor down into register `name`,
+	// in one piece
+	void yankLines(size_t count, char name = Registers::UNNAMED) {
+		size_t last = lastLineOf(count);
+		size_t start = text.lineStart(current_line);
+		registers->yanked(name, make_shared<const string>(text.substr(start, text.lineEnd(last) - start)));
+		updateStatus("Yanked " + linesText(last - current_line + 1));
+	}
+
+	// Runs a line command given a count: the command acts on that many
+	// lines at once, or j moves that far. No count means 1. dd and yy keep
+	// the lines in register `name`.
+	void executeWithCount(int count, const string& cmd, char name = Registers::UNNAMED) {
+		size_t lines = max(count, 1);
+		if (cmd == "dd") {
+			deleteLines(lines, name);
+		}
+		else if (cmd == "yy") {
+			yankLines(lines, name);
+		}
+		else if (cmd == "j") {
+			if (current_line + 1 >= text.lineCount()) {
+				failed = true;
+				return;
+			}
+			current_line = lastLineOf(lines + 1);
+			cursorToLineStart();
+		}
+		else if (cmd == ">>") {
+			shiftLines(lines, true);
+		}
+		else if (cmd == "<<") {
+			shiftLines(lines, false);
+		}
+	}
+	void moveToColumn(size_t column) {
+		cursorCol = min(column + 1, currentLine().length);
+	}
+	void search(const string& str) {
+		if (searchEngine.search(text, str)) {
+			current_line = searchEngine.lastMatchLine;
+			moveToColumn(searchEngine.lastMatchColumn);
+			updateStatus("Search: " + str);
+		}
+		else if (!searchEngine.lastError.empty()) {
+			fail("Invalid pattern: " + searchEngine.lastError);
+		}
+		else {
+			fail("Pattern not found: " + str);
+		}
+	}
+
+	void findNext() {
+		if (searchEngine.findNext(text)) {
+			current_line = searchEngine.lastMatchLine;
+			moveToColumn(searchEngine.lastMatchColumn);
+			updateStatus("Find Next");
+		}
+		else {
+			fail("No more occurrences found");
+		}
+	}
+
+
+	void findPrevious() {
+		if (searchEngine.findPrevious(text)) {
+			current_line = searchEngine.lastMatchLine;
+			moveToColumn(searchEngine.lastMatchColumn);
+			updateStatus("Find Previous");
+		}
+		else {
+			fail("No previous occurrences found");
+		}
+	}
+
+	// Reads a line number typed in decimal; false when it does not fit
+	static bool parseNumber(const string& digits, size_t& value) {
+		value = 0;
+		for (char c : digits) {
+			size_t digit = c - '0';
+			if (value > (SIZE_MAX - digit) / 10) return false;
+			value = value * 10 + digit;
+		}
+		return true;
+	}
+
+	// Reads an optional line range at the start of an ex command: "%", or one
+	// or two addresses (a line number, "." or "$") separated by ",". Without
+	// one the range is the current line. `used` receives its length. False
+	// when an address is malformed or past the last line.
+	bool parseRange(const string& cmd, size_t& used, size_t& first, size_t& last) const {
+		size_t lineCount = text.lineCount();
+		used = 0;
+		first = last = current_line;
+		if (cmd.compare(0, 1, "%") == 0) {
+			used = 1;
+			first = 0;
+			last = lineCount - 1;
+			return true;
+		}
+		bool invalid = false;
+		auto address = [&](size_t& line) {
+			if (used < cmd.size() && (cmd[used] == '.' || cmd[used] == '$')) {
+				line = cmd[used++] == '.' ? current_line : lineCount - 1;
+				return true;
+			}
+			size_t digits = used;
+			while (digits < cmd.size() && isdigit(static_cast<unsigned char>(cmd[digits]))) digits++;
+			if (digits == used) return false;
+			if (!parseNumber(cmd.substr(used, digits - used), line) || line > lineCount) {
+				invalid = true;
+				return false;
+			}
+			line = line > 0 ? line - 1 : 0;
+			used = digits;
+			return true;
+			};
+		if (!address(first)) return !invalid;
+		last = first;
+		if (used < cmd.size() && cmd[used] == ',') {
+			used++;
+			if (!address(last)) return false;
+		}
+		if (first > last) swap(first, last);
+		return true;
+	}
+
+	// :[range]s/pattern/replacement/[g]; the replacement may refer to groups
+	// as \1-\9. Only the matched spans are rewritten. No match is a failure
+	// unless `missingOk`.
+	void substitute(size_t first, size_t last, const string& pattern, const string& replacement, bool global, bool missingOk = false) {
+		auto started = chrono::steady_clock::now();
+		shared_ptr<const Regex> re = searchEngine.compile(pattern);
+		if (!re) {
+			fail("Invalid pattern: " + searchEngine.lastError);
+			return;
+		}
+
+		vector<PieceTable::Splice> edits;
+		SearchEngine::SubstituteCount count = searchEngine.substitutions(text, *re, first, last, replacement, global, edits);
+		if (count.substitutions == 0) {
+			if (missingOk) {
+				updateStatus("No occurrences found to replace.");
+			}
+			else {
+				fail("No occurrences found to replace.");
+			}
+			return;
+		}
+		if (!edits.empty()) {
+			current_line = applyEdits(edits);
+			cursorToLineStart();
+			markModified();
+		}
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+		ostringstream message;
+		message << count.substitutions << " substitution" << (count.substitutions == 1 ? "" : "s")
+			<< " on " << count.lines << " line" << (count.lines == 1 ? "" : "s")
+			<< " (" << fixed << setprecision(1) << ms << " ms)";
+		updateStatus(message.str());
+	}
+
+	// Applies splices given in document order and returns the line where
+	// the last one ends up
+	size_t applyEdits(const vector<PieceTable::Splice>& edits) {
+		size_t lastOffset = edits.back().offset;
+		vector<string> removed;
+		removed.reserve(edits.size());
+		for (size_t i = 0; i < edits.size(); ++i) {
+			if (i + 1 < edits.size()) lastOffset += edits[i].text.size() - edits[i].length;
+			removed.push_back(text.substr(edits[i].offset, edits[i].length));
+		}
+		history.recordSplices(edits, move(removed), cursor());
+		text.splice(edits);
+		return text.lineOf(lastOffset);
+	}
+
+	// Sets the option named in a :set command. The only one is undolimit,
+	// the bytes of text the undo history may keep, with an optional k or m
+	// suffix; the oldest changes are dropped to fit it.
+	void setOption(const string& option) {
+		size_t equals = option.find('=');
+		string name = option.substr(0, equals);
+		if (name != "undolimit") {
+			fail("Unknown option: " + name);
+			return;
+		}
+		if (equals == string::npos) {
+			updateStatus("undolimit=" + to_string(history.memoryLimit()));
+			return;
+		}
+		string value = option.substr(equals + 1);
+		size_t scale = 1;
+		if (!value.empty() && (value.back() == 'k' || value.back() == 'm')) {
+			scale = value.back() == 'k' ? 1 << 10 : 1 << 20;
+			value.pop_back();
+		}
+		size_t bytes;
+		if (value.empty() || !all_of(value.begin(), value.end(), ::isdigit) || !parseNumber(value, bytes) || bytes > SIZE_MAX / scale) {
+			fail("Invalid undolimit: " + option.substr(equals + 1));
+			return;
+		}
+		history.setMemoryLimit(bytes * scale);
+		updateStatus("undolimit=" + to_string(bytes * scale));
+	}
+
+	// Runs an ex command that only needs the text: an address to go to, a
+	// range followed by s/old/new/[g], d, y, >, < or pu, where d, y and pu
+	// may name a register ("d a"), or set. False when it is none of these.
+	bool exCommand(const string& cmd) {
+		if (!cmd.empty() && all_of(cmd.begin(), cmd.end(), ::isdigit)) {
+			size_t line;
+			if (parseNumber(cmd, line)) {
+				gotoLine(line);
+			}
+			else {
+				fail("Invalid line number");
+			}
+			return true;
+		}
+		size_t used, first, last;
+		if (!parseRange(cmd, used, first, last)) {
+			fail("Invalid range");
+			return true;
+		}
+		if (used > 0 && used == cmd.size()) {
+			gotoLine(last + 1);
+			return true;
+		}
+		if (cmd.compare(used, 2, "s/") == 0) {
+			string pattern, replacement;
+			bool global, missingOk;
+			if (SearchEngine::parseSubstitute(cmd.substr(used + 2), pattern, replacement, global, missingOk)) {
+				substitute(first, last, pattern, replacement, global, missingOk);
+			}
+			else {
+				fail("Invalid replace command. Use :[range]s/old/new/[flags], with flags g and e.");
+			}
+			return true;
+		}
+		size_t space = cmd.find(' ', used);
+		string name = cmd.substr(used, space == string::npos ? string::npos : space - used);
+		size_t start = space == string::npos ? string::npos : cmd.find_first_not_of(' ', space);
+		string argument = start == string::npos ? "" : cmd.substr(start);
+		if (name == "set" && used == 0 && !argument.empty()) {
+			setOption(argument);
+			return true;
+		}
+		char reg = Registers::UNNAMED;
+		if (argument.size() == 1 && Registers::isName(argument[0])) {
+			reg = argument[0];
+		}
+		else if (!argument.empty() || (name != "d" && name != "y" && name != "pu" && name != ">" && name != "<")) {
+			return false;
+		}
+		size_t lines = last - first + 1;
+		if (name == "d") {
+			current_line = first;
+			deleteLines(lines, reg);
+		}
+		else if (name == "y") {
+			size_t line = current_line;
+			current_line = first;
+			yankLines(lines, reg);
+			current_line = line;
+		}
+		else if (name == "pu") {
+			current_line = last;
+			pasteAfter(reg);
+		}
+		else if (reg != Registers::UNNAMED) {
+			return false;
+		}
+		else {
+			current_line = first;
+			shiftLines(lines, name == ">");
+		}
+		return true;
+	}
+
+
+	void saveToFile(const string& filename) {
+		if (fileManager.saveFile(filename, text)) {
+			const FileManager::SaveReport& report = fileManager.lastSave;
+			if (report.skipped) {
+				updateStatus("No changes to save in " + filename);
+				return;
+			}
+			journal.discard();
+			double megabytes = report.bytes / 1048576.0;
+			ostringstream message;
+			message << "Saved " << filename << " (" << report.bytes << " bytes in "
+				<< fixed << setprecision(1) << report.seconds * 1000 << " ms, "
+				<< (report.seconds > 0 ? megabytes / report.seconds : 0) << " MB/s)";
+			if (sideFiles) {
+				baseLength = text.length();
+				baseKnown = true;
+				if (!history.save(FileManager::undoFileName(filename), text, cursor())) {
+					message << "; could not write the undo file";
+				}
+			}
+			updateStatus(message.str());
+		}
+		else {
+			fail("Failed to save " + filename);
+		}
+	}
+
+	bool loadFromFile(const string& filename) {
+		searchEngine.detach();
+		bool loaded = fileManager.loadFile(filename, text);
+		searchEngine.attach(text);
+		if (loaded) {
+			layout.clear();
+			journal.discard();
+			baseKnown = false;
+			history.clear(sideFiles ? FileManager::undoFileName(filename) : "");
+			current_line = 0;
+			cursorToLineStart();
+			updateStatus("File Loaded");
+			if (sideFiles) {
+				recoverSwapFile(filename);
+			}
+		}
+		else {
+			clampCursor();
+			fail("Failed to load " + filename);
+		}
+		return loaded;
+	}
+
+	// Whether edits are logged to a swap file and the undo history is kept
+	// next to the file when it is saved. Scripted runs go without.
+	void useSideFiles(bool use) {
+		sideFiles = use;
+	}
+	// Whether large files get a search index built in the background. Takes
+	// effect from the next load.
+	void useSearchIndex(bool use) {
+		searchEngine.useIndex(use);
+	}
+	// The message on the status line
+	const string& statusMessage() const {
+		return status.lastCommand;
+	}
+
+	void markModified() {
+		fileManager.markAsModified();
+	}
+
+	bool hasUnsavedChanges() {
+		return fileManager.hasUnsavedChanges();
+	}
+
+	string getFileName() {
+		return fileManager.getCurrentFileName();
+	}
+	size_t countCharactersInLine(size_t line) {
+		return text.lineLength(line);
+	}
+	void insert(char ch) {
+		LineInfo line = currentLine();
+		insertText(line.start + cursorCol, &ch, 1);
+		if (ch == '\n') {
+			// The rest of the line moves to a new one, with the cursor before
+			// it. That line starts after the break and is known without a
+			// lookup.
+			current_line++;
+			lineInfo = LineInfo{ current_line, text.version(), line.start + cursorCol + 1, line.length - cursorCol };
+			cursorCol = 0;
+		}
+		else {
+			cursorCol++;
+			lineResized(line, 1);
+		}
+		markModified();
+		updateStatus("Insert");
+	}
+
+
+	void moveUp() {
+		if (current_line > 0) {
+			current_line--;
+			cursorToLineStart();
+		}
+		else {
+			failed = true;
+		}
+	}
+
+	void moveDown() {
+		if (current_line < text.lineCount() - 1) {
+			current_line++;
+			cursorToLineStart();
+		}
+		else {
+			failed = true;
+		}
+	}
+
+	void gotoLine(size_t lineNum) {
+		if (lineNum < 1 || lineNum > text.lineCount()) {
+			fail("Invalid line number");
+			return;
+		}
+		current_line = lineNum - 1;
+		cursorToLineStart();
+		updateStatus("Go to line " + to_string(lineNum));
+	}
+
+	void moveRight() {
+		if (cursorCol > 0 && cursorCol < currentLine().length) {
+			cursorCol++;
+		}
+		else {
+			failed = true;
+		}
+	}
+
+	void moveLeft() {
+		if (cursorCol > 1) {
+			cursorCol--;
+		}
+		else {
+			failed = true;
+		}
+	}
+
+	void enterInsertMode() {
+		insertMode = true;
+	}
+
+	void exitInsertMode() {
+		insertMode = false;
+		history.seal(cursor());
+	}
+
+	// Called before each normal-mode command so every command is its own
+	// undo step, while a whole stay in insert mode makes up one.
+	void sealUndoStep() {
+		history.seal(cursor());
+	}
+
+	void undo() {
+		UndoHistory::Cursor position = cursor();
+		if (!history.undo(text, position)) {
+			updateStatus("Already at oldest change");
+			return;
+		}
+		current_line = position.line;
+		cursorCol = position.column;
+		clampCursor();
+		markModified();
+		updateStatus("Undo");
+	}
+
+	void redo() {
+		UndoHistory::Cursor position = cursor();
+		if (!history.redo(text, position)) {
+			updateStatus("Already at newest change");
+			return;
+		}
+		current_line = position.line;
+		cursorCol = position.column;
+		clampCursor();
+		markModified();
+		updateStatus("Redo");
+	}
+
+	bool isInsertMode() const {
+		return insertMode;
+	}
+	void deleteToEndOfLine() {
+		if (cursorCol == 0) {
+			return;
+		}
+		size_t offset = cursorOffset() - 1;
+		eraseText(offset, text.lineEnd(current_line) - offset);
+		cursorCol--;
+		markModified();
+	}
+	void deleteCharacterAtCursor() {
+		if (cursorCol == 0) {
+			return;
+		}
+		LineInfo line = currentLine();
+		eraseText(line.start + cursorCol - 1, 1);
+		lineResized(line, -1);
+		// The cursor moves to the following character, or back onto the
+		// previous one when the last character went away
+		clampCursor();
+		markModified();
+	}
+	void backspace() {
+		if (cursorCol < 2) {
+			return;
+		}
+		LineInfo line = currentLine();
+		eraseText(line.start + cursorCol - 2, 1);
+		lineResized(line, -1);
+		cursorCol--;
+		markModified();
+	}
+	// Puts the lines in register `name` below or above the cursor line
+	void pasteAfter(char name = Registers::UNNAMED) {
+		Registers::Text lines = registers->get(name);
+		if (!lines) {
+			fail(string("Nothing in register ") + name);
+			return;
+		}
+		insertBlock(text.lineEnd(current_line), { "\n", lines });
+		current_line++;
+		cursorToLineStart();
+		updateStatus("Paste After");
+	}
+	void pasteBefore(char name = Registers::UNNAMED) {
+		Registers::Text lines = registers->get(name);
+		if (!lines) {
+			fail(string("Nothing in register ") + name);
+			return;
+		}
+		insertBlock(text.lineStart(current_line), { lines, "\n" });
+		cursorToLineStart();
+		updateStatus("Paste Before");
+	}
+	// Inserts pasted text at the cursor in one edit that is undone on its
+	// own, leaving the cursor at its end. Terminals send line breaks as CR.
+	void paste(const string& pasted) {
+		string data;
+		data.reserve(pasted.size());
+		for (size_t i = 0; i < pasted.size(); ++i) {
+			if (pasted[i] != '\r') {
+				data += pasted[i];
+			}
+			else if (i + 1 == pasted.size() || pasted[i + 1] != '\n') {
+				data += '\n';
+			}
+		}
+		if (data.empty()) return;
+		UndoHistory::Cursor end = insertBlock(cursorOffset(), { data });
+		current_line = end.line;
+		cursorCol = end.column;
+		updateStatus("Pasted " + to_string(data.size()) + " bytes");
+	}
+	// :r reads a file into the text below the cursor line
+	void readIntoText(const string& filename) {
+		string content;
+		if (!FileManager::readFile(filename, content)) {
+			fail("Failed to read " + filename);
+			return;
+		}
+		// A final '\n' ends the last line read rather than starting another
+		size_t lines = count(content.begin(), content.end(), '\n');
+		if (!content.empty() && content.back() != '\n') {
+			lines++;
+		}
+		if (lines == 0) {
+			updateStatus("Read 0 lines from " + filename);
+			return;
+		}
+		if (content.back() == '\n') {
+			content.pop_back();
+		}
+		insertBlock(text.lineEnd(current_line), { "\n", content });
+		current_line++;
+		cursorToLineStart();
+		updateStatus("Read " + to_string(lines) + " lines from " + filename);
+	}
+	void moveToStartOfLine() {
+		cursorToLineStart();
+	}
+	void moveToEndOfLine() {
+		cursorCol = currentLine().length;
+	}
+	void moveToNextWord() {
+		if (cursorCol == 0 || cursorCol >= currentLine().length) {
+			if (current_line + 1 < text.lineCount()) {
+				current_line++;
+				cursorToLineStart();
+			}
+			else {
+				failed = true;
+			}
+			return;
+		}
+		string line = text.getLine(current_line);
+		size_t i = cursorCol - 1;
+		while (i + 1 < line.size() && !isWordCharacter(line[i])) {
+			i++;
+		}
+		while (i + 1 < line.size() && isWordCharacter(line[i])) {
+			i++;
+		}
+		while (i + 1 < line.size() && !isWordCharacter(line[i])) {
+			i++;
+		}
+		cursorCol = i + 1;
+	}
+	void moveToPreviousWord() {
+		if (cursorCol <= 1) {
+			if (current_line > 0) {
+				current_line--;
+				moveToEndOfLine();
+			}
+			else {
+				failed = true;
+			}
+			return;
+		}
+
+		string line = text.getLine(current_line);
+		size_t i = cursorCol - 1;
+		while (i > 0 && (line[i] == ' ' || isPunctuation(line[i]))) {
+			i--;
+		}
+		while (i > 0 && isWordCharacter(line[i])) {
+			i--;
+		}
+		if (!isWordCharacter(line[i]) && i + 1 < line.size()) {
+			i++;
+		}
+		cursorCol = i + 1;
+	}
+
+
+	void moveToWordEnd() {
+		string line = text.getLine(current_line);
+		if (cursorCol == 0 || cursorCol >= line.size()) {
+			return;
+		}
+		size_t i = cursorCol - 1;
+		while (i + 1 < line.size() && isPunctuation(line[i + 1])) {
+			i++;
+		}
+		while (i + 1 < line.size() && isWordCharacter(line[i + 1])) {
+			i++;
+		}
+		cursorCol = i + 1;
+	}
+	// Records that a command failed, which ends a macro being replayed
+	void fail(const string& message) {
+		failed = true;
+		updateStatus(message);
+	}
+	// Whether a command has failed since the last call
+	bool takeFailure() {
+		bool was = failed;
+		failed = false;
+		return was;
+	}
+	void updateStatus(const string& lastCommand = "") {
+		status.currentMode = insertMode ? "INSERT" : "NORMAL";
+		status.cursorLine = current_line + 1;
+		status.cursorColumn = getCursorColumn();
+		status.totalLines = text.lineCount();
+		bool onMatch = searchEngine.isCurrent(text) && searchEngine.matchCount() > 0;
+		status.matchCount = onMatch ? searchEngine.matchCount() : 0;
+		status.matchNumber = onMatch ? searchEngine.currentMatch + 1 : 0;
+		if (!lastCommand.empty()) {
+			status.lastCommand = lastCommand;
+		}
+	}
+	size_t getCursorColumn() {
+		return cursorCol == 0 ? 1 : cursorCol;
+	}
+	size_t getCursorLine() const {
+		return current_line + 1;
+	}
+	// Rows `line` takes on screen
+	size_t rowsOf(size_t line) {
+		string scratch;
+		return layout.rows(line, text.lineView(line, scratch)).size();
+	}
+	// Offset in the cursor line of what the cursor shows: the insertion
+	// point in insert mode, the character in normal mode
+	size_t cursorByte() const {
+		return insertMode || cursorCol == 0 ? cursorCol : cursorCol - 1;
+	}
+	// Moves the top of the screen as little as possible to show the row
+	// `row` of the cursor line
+	void scrollToCursor(size_t row) {
+		size_t textRows = this->textRows();
+		if (current_line < topLine || (current_line == topLine && row < topRow)) {
+			topLine = current_line;
+			topRow = row;
+			return;
+		}
+		// Rows from the top of the screen down to the cursor, counted until
+		// they are known not to fit
+		size_t used = row + 1;
+		for (size_t line = topLine; line < current_line && used <= textRows; ++line) {
+			used += rowsOf(line) - (line == topLine ? topRow : 0);
+		}
+		if (used <= textRows) return;
+		// Fill the screen upwards from the cursor row
+		size_t line = current_line;
+		for (size_t above = textRows - 1; above > 0; --above) {
+			if (row > 0) {
+				row--;
+			}
+			else if (line > 0) {
+				line--;
+				row = rowsOf(line) - 1;
+			}
+			else {
+				break;
+			}
+		}
+		topLine = line;
+		topRow = row;
+	}
+
+	// Draws the lines around the cursor, wrapping long ones. Only the lines
+	// on screen are read, and only the rows that changed since the last
+	// frame are sent.
+	void display() {
+		screen.followResize();
+		size_t textRows = this->textRows();
+		size_t gutter = to_string(text.lineCount()).size() + 1;    // Number and '|'
+		layout.setWidth(max<size_t>(screen.columns() - min(gutter, screen.columns()), 8));
+		string scratch;
+		size_t cursorLineRow = layout.rowOf(current_line, text.lineView(current_line, scratch), cursorByte());
+		scrollToCursor(cursorLineRow);
+
+		vector<string> frame;
+		frame.reserve(screen.rows());
+		string rule(min<size_t>(33, screen.columns()), '-');
+		frame.push_back(rule);
+		size_t cursorRow = 1;
+		size_t cursorColumn = gutter;
+		size_t line = topLine;
+		size_t row = topRow;
+		while (frame.size() <= textRows) {
+			if (line >= text.lineCount()) {
+				frame.push_back("~");
+				continue;
+			}
+			string_view lineText = text.lineView(line, scratch);
+			const vector<size_t>& starts = layout.rows(line, lineText);
+			for (; row < starts.size() && frame.size() <= textRows; ++row) {
+				size_t from = starts[row];
+				size_t to = row + 1 < starts.size() ? starts[row + 1] : lineText.size();
+				string cells;
+				if (row == 0) {
+					string number = to_string(line + 1);
+					cells.assign(gutter - 1 - number.size(), ' ');
+					cells += number;
+					cells += '|';
+				}
+				else {
+					cells.assign(gutter, ' ');
+				}
+				screen.appendCells(cells, lineText.substr(from, to - from));
+				if (line == current_line && row == cursorLineRow) {
+					cursorRow = frame.size();
+					cursorColumn = gutter + Screen::widthOf(lineText.substr(from, cursorByte() - from));
+				}
+				frame.push_back(move(cells));
+			}
+			line++;
+			row = 0;
+		}
+		frame.push_back(rule);
+
+		ostringstream statusLine;
+		statusLine << "Mode: " << status.currentMode
+			<< " | File: " << fileManager.getCurrentFileName()
+			<< (fileManager.hasUnsavedChanges() ? " [+]" : "")
+			<< " | Line: " << status.cursorLine << "/" << status.totalLines
+			<< " | Column: " << status.cursorColumn;
+		if (status.matchCount > 0) {
+			statusLine << " | Match " << status.matchNumber << " of " << status.matchCount;
+		}
+		statusLine << " | Last: " << status.lastCommand;
+		string statusRow;
+		screen.appendCells(statusRow, statusLine.str());
+		frame.push_back(move(statusRow));
+		frame.push_back(string());
+		screen.draw(frame, cursorRow, cursorColumn);
+	}
+	// Lines of text on screen, leaving a rule above and below them, the
+	// status line and the command line
+	size_t textRows() const {
+		return screen.rows() - 4;
+	}
+	// Ctrl-F and Ctrl-B: a screen forward or back, keeping two lines of the
+	// previous one in view. The cursor stays on screen.
+	void scrollPage(bool forward) {
+		size_t step = textRows() > 2 ? textRows() - 2 : 1;
+		if (forward) {
+			topLine = min(topLine + step, text.lineCount() - 1);
+			topRow = 0;
+			current_line = max(current_line, topLine);
+		}
+		else {
+			topLine = topLine > step ? topLine - step : 0;
+			topRow = 0;
+			current_line = min(current_line, topLine + textRows() - 1);
+		}
+		cursorToLineStart();
+		updateStatus(forward ? "Page Down" : "Page Up");
+	}
+	// Ctrl-D and Ctrl-U: the text and the cursor move by half a screen
+	void scrollHalfPage(bool forward) {
+		size_t step = max<size_t>(textRows() / 2, 1);
+		size_t lastLine = text.lineCount() - 1;
+		if (forward) {
+			topLine = min(topLine + step, lastLine);
+			topRow = 0;
+			current_line = min(current_line + step, lastLine);
+		}
+		else {
+			topLine = topLine > step ? topLine - step : 0;
+			topRow = 0;
+			current_line = current_line > step ? current_line - step : 0;
+		}
+		cursorToLineStart();
+		updateStatus(forward ? "Half Page Down" : "Half Page Up");
+	}
+	// zz: scrolls so the cursor line is in the middle of the screen
+	void centerCursorLine() {
+		size_t half = textRows() / 2;
+		topLine = current_line > half ? current_line - half : 0;
+		topRow = 0;
+		updateStatus("Center Line");
+	}
+	// gj and gk: down or up one row on screen, which differs from a line
+	// when lines wrap. The cursor keeps its column within the row.
+	void moveScreenRow(bool down) {
+		string scratch;
+		string_view lineText = text.lineView(current_line, scratch);
+		const vector<size_t> starts = layout.rows(current_line, lineText);
+		size_t at = cursorCol > 0 ? cursorCol - 1 : 0;
+		size_t row = upper_bound(starts.begin(), starts.end(), at) - starts.begin() - 1;
+		size_t column = Screen::widthOf(lineText.substr(starts[row], at - starts[row]));
+		if (down) {
+			if (row + 1 < starts.size()) {
+				row++;
+			}
+			else if (current_line + 1 < text.lineCount()) {
+				current_line++;
+				row = 0;
+			}
+			else {
+				return;
+			}
+		}
+		else {
+			if (row > 0) {
+				row--;
+			}
+			else if (current_line > 0) {
+				current_line--;
+				row = rowsOf(current_line) - 1;
+			}
+			else {
+				return;
+			}
+		}
+		lineText = text.lineView(current_line, scratch);
+		const vector<size_t>& target = layout.rows(current_line, lineText);
+		size_t from = target[row];
+		size_t to = row + 1 < target.size() ? target[row + 1] : lineText.size();
+		// The last character that starts at or before the column
+		size_t offset = from;
+		for (size_t i = from; i < to; ++i) {
+			if (Screen::continuation(lineText[i])) continue;
+			if (Screen::widthOf(lineText.substr(from, i - from)) > column) break;
+			offset = i;
+		}
+		cursorCol = lineText.empty() ? 0 : offset + 1;
+		updateStatus(down ? "Row Down" : "Row Up");
+	}
+	// Leaves the cursor on the command line for a prompt
+	void openCommandLine() {
+		screen.release(screen.rows() - 1);
+	}
+	// Repaints the whole screen next time, after other output
+	void redrawScreen() {
+		screen.invalidate();
+	}
+
+	// Uses the registers of `other`, for a buffer opened in the same session
+	void shareRegisters(const TextEditor& other) {
+		registers = other.registers;
+	}
+	// Registers of the session, which also hold the macros
+	Registers& getRegisters() {
+		return *registers;
+	}
+	// Bytes held for the text, its undo history and its search index
+	size_t memoryUsage() const {
+		return text.memoryUsage() + history.memoryUsage() + searchEngine.memoryUsage();
+	}
+	bool isEvicted() const {
+		return evicted;
+	}
+	// Trims what a buffer off screen does not need
+	void compact() {
+		layout.clear();
+		text.compact();
+	}
+	// Drops the text of an unmodified buffer, which is read again from its
+	// file by activate(). The cursor and undo history stay. False when the
+	// file is the only copy of the text.
+	bool evict() {
+		string filename = fileManager.getCurrentFileName();
+		if (evicted || filename.empty() || fileManager.hasUnsavedChanges()) {
+			return false;
+		}
+		evictedHash = text.hash();
+		evictedLength = text.length();
+		searchEngine.detach();
+		journal.discard();
+		layout.clear();
+		text.clear();
+		evicted = true;
+		return true;
+	}
+	// Takes over the screen from another buffer, reading the text back in
+	// if it was evicted. The frame on the terminal is not ours, and it may
+	// have been resized meanwhile.
+	void activate() {
+		if (evicted) {
+			evicted = false;
+			string filename = fileManager.getCurrentFileName();
+			if (!fileManager.loadFile(filename, text)) {
+				updateStatus("Failed to read " + filename + " again");
+			}
+			searchEngine.attach(text);
+			baseKnown = false;
+			if (text.length() != evictedLength || text.hash() != evictedHash) {
+				// The undo steps were made on other text
+				history.clear(FileManager::undoFileName(filename));
+				updateStatus(filename + " changed on disk and was read again");
+			}
+			clampCursor();
+		}
+		screen.attach();
+		screen.querySize();
+		screen.invalidate();
+	}
+
+};
+
+
+// The buffers of a session, each a TextEditor with its own file, cursor,
+// undo history and swap file, all sharing one set of registers. Whenever
+// another buffer comes on screen, the others are compacted, and while they
+// all hold more than MEMORY_LIMIT the unmodified ones are evicted to be read
+// from their files again, least recently used first.
+class BufferList {
+	vector<unique_ptr<TextEditor>> buffers;
+	vector<size_t> lastUsed;    // Tick each buffer was last on screen
+	size_t active;
+	size_t tick;
+
+	void enforceLimit() {
+		size_t total = 0;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			if (i != active) buffers[i]->compact();
+			total += buffers[i]->memoryUsage();
+		}
+		vector<size_t> order;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			if (i != active) order.push_back(i);
+		}
+		sort(order.begin(), order.end(), [this](size_t a, size_t b) { return lastUsed[a] < lastUsed[b]; });
+		for (size_t i : order) {
+			if (total <= MEMORY_LIMIT) break;
+			size_t before = buffers[i]->memoryUsage();
+			if (buffers[i]->evict()) {
+				total -= before - buffers[i]->memoryUsage();
+			}
+		}
+	}
+
+public:
+	static constexpr size_t MEMORY_LIMIT = 256 << 20;
+
+	BufferList() : active(0), tick(0) {
+		buffers.push_back(make_unique<TextEditor>());
+		lastUsed.push_back(0);
+	}
+
+	// Puts buffer `index` on screen
+	void show(size_t index) {
+		active = index;
+		lastUsed[active] = ++tick;
+		buffers[active]->activate();
+		enforceLimit();
+	}
+	TextEditor& current() {
+		return *buffers[active];
+	}
+	size_t size() const {
+		return buffers.size();
+	}
+
+	// :e switches to the buffer of `filename`, or opens it in a new one.
+	// An unnamed and unmodified buffer is reused.
+	void open(const string& filename) {
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			if (buffers[i]->getFileName() == filename) {
+				show(i);
+				return;
+			}
+		}
+		TextEditor& here = current();
+		if (!here.getFileName().empty() || here.hasUnsavedChanges()) {
+			buffers.push_back(make_unique<TextEditor>());
+			buffers.back()->shareRegisters(here);
+			lastUsed.push_back(0);
+			show(buffers.size() - 1);
+		}
+		current().loadFromFile(filename);
+		enforceLimit();
+	}
+	// :bn and :bp, wrapping around
+	void next() {
+		show((active + 1) % buffers.size());
+	}
+	void previous() {
+		show((active + buffers.size() - 1) % buffers.size());
+	}
+	// :bd closes the current buffer, unless it has unsaved changes. The last
+	// one is replaced by an empty buffer.
+	bool close() {
+		if (current().hasUnsavedChanges()) {
+			return false;
+		}
+		if (buffers.size() == 1) {
+			auto fresh = make_unique<TextEditor>();
+			fresh->shareRegisters(current());
+			buffers[0] = move(fresh);
+			show(0);
+			return true;
+		}
+		buffers.erase(buffers.begin() + active);
+		lastUsed.erase(lastUsed.begin() + active);
+		show(min(active, buffers.size() - 1));
+		return true;
+	}
+	// First buffer with unsaved changes, or -1
+	int unsaved() {
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			if (buffers[i]->hasUnsavedChanges()) return static_cast<int>(i);
+		}
+		return -1;
+	}
+	// A line per buffer for :ls: its number, % for the current one, + when
+	// modified or - when evicted, its name, cursor line and memory held
+	vector<string> list() {
+		vector<string> lines;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			TextEditor& buffer = *buffers[i];
+			string name = buffer.getFileName();
+			ostringstream line;
+			line << setw(3) << i + 1 << ' ' << (i == active ? '%' : ' ')
+				<< (buffer.hasUnsavedChanges() ? '+' : buffer.isEvicted() ? '-' : ' ')
+				<< " \"" << (name.empty() ? "[No Name]" : name) << "\""
+				<< "  line " << buffer.getCursorLine()
+				<< "  " << fixed << setprecision(1) << buffer.memoryUsage() / 1048576.0 << " MB";
+			lines.push_back(line.str());
+		}
+		return lines;
+	}
+};
+
+class CommandMode {
+
+public:    vector<string> commandHistory;    int index = -1;
+	  void addCommandToHistory(const string& command) {
+		  commandHistory.push_back(command);
+		  index = commandHistory.size();
+	  }
+
+	  string getPreviousCommand() {
+		  if (index > 0) {
+			  index--;
+			  return commandHistory[index];
+		  }
+		  return "";
+	  }
+
+	  string getNextCommand() {
+		  if (index < commandHistory.size() - 1) {
+			  index++;
+			  return commandHistory[index];
+		  }
+		  return "";
+	  }
+};
+// Keys that are not a single character, numbered above every byte value
+enum Key {
+	KEY_UP = 0x100, KEY_DOWN, KEY_RIGHT, KEY_LEFT,
+	KEY_HOME, KEY_END, KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_INSERT, KEY_DELETE,
+	KEY_F1, KEY_F12 = KEY_F1 + 11,
+	KEY_PASTE,          // Bracketed paste; the text is in pastedText()
+	KEY_UNKNOWN,        // An escape sequence we do not handle
+	KEY_RESIZE,         // A signal, such as SIGWINCH, interrupted the wait
+	KEY_EOF             // Input was closed
+};
+
+// The terminal for the whole session. Raw mode is entered once and restored
+// on exit or when a signal ends the process; input is read in blocks with
+// read() as poll() reports it and decoded from a buffer, so a burst of
+// input such as a paste costs a few system calls rather than several per
+// byte.
+class Terminal {
+	string input;
+	size_t next;        // First byte of `input` not decoded yet
+	string pasted;
+
+	// A macro being replayed: its keys, where it is in them and how many
+	// more times to go through them. A paste is kept as KEY_PASTE, its
+	// length and its bytes.
+	struct Playback {
+		vector<int> keys;
+		size_t next;
+		size_t repeats;
+	};
+	vector<Playback> playing;   // Innermost last
+	vector<int> recorded;
+	bool recording;
+
+	// Macros calling macros deeper than this are taken to be runaway
+	static constexpr size_t MAX_PLAYBACK_DEPTH = 100;
+	static constexpr int ESCAPE_KEY = 0x80;    // See keysToText()
+
+	int replayKey() {
+		Playback& top = playing.back();
+		int key = top.keys[top.next++];
+		if (key == KEY_PASTE) {
+			size_t length = top.keys[top.next++];
+			pasted.clear();
+			for (size_t i = 0; i < length; ++i) {
+				pasted += static_cast<char>(top.keys[top.next++]);
+			}
+		}
+		// A finished macro is dropped before its last key runs, so one that
+		// ends by calling itself does not nest
+		if (top.next == top.keys.size()) {
+			if (--top.repeats > 0) {
+				top.next = 0;
+			}
+			else {
+				playing.pop_back();
+			}
+		}
+		return key;
+	}
+
+	// Time an escape sequence may take to arrive after its ESC
+	static constexpr int ESCAPE_WAIT_MS = 25;
+	enum Fill { FILLED, TIMED_OUT, INTERRUPTED, CLOSED };
+
+#if defined(linux) || defined(APPLE)
+	static inline struct termios saved;
+	static inline volatile sig_atomic_t raw = 0;
+
+	static void enterRaw() {
+		struct termios settings = saved;
+		settings.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+		settings.c_iflag &= ~IXON;      // Ctrl-S and Ctrl-Q are keys too
+		settings.c_cc[VMIN] = 1;
+		settings.c_cc[VTIME] = 0;
+		raw = tcsetattr(STDIN_FILENO, TCSANOW, &settings) == 0;
+		if (raw) {
+			// Ask for pastes to arrive between ESC [200~ and ESC [201~
+			static const char BRACKETED_PASTE_ON[] = "\x1b[?2004h";
+			ssize_t ignored = write(STDOUT_FILENO, BRACKETED_PASTE_ON, sizeof BRACKETED_PASTE_ON - 1);
+			(void)ignored;
+		}
+	}
+	static void restore() {
+		if (raw) {
+			static const char BRACKETED_PASTE_OFF[] = "\x1b[?2004l";
+			ssize_t ignored = write(STDOUT_FILENO, BRACKETED_PASTE_OFF, sizeof BRACKETED_PASTE_OFF - 1);
+			(void)ignored;
+			tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+			raw = 0;
+		}
+	}
+	static void onFatalSignal(int signal) {
+		restore();
+		::signal(signal, SIG_DFL);
+		raise(signal);
+	}
+	static void onContinue(int) {
+		enterRaw();     // The shell may have reset the terminal while stopped
+	}
+
+	// Waits up to `timeout` ms, or forever when negative, and appends what
+	// arrived to `input`
+	Fill fill(int timeout) {
+		struct pollfd wait = { STDIN_FILENO, POLLIN, 0 };
+		int ready = poll(&wait, 1, timeout);
+		if (ready < 0) {
+			return errno == EINTR ? INTERRUPTED : CLOSED;
+		}
+		if (ready == 0) {
+			return TIMED_OUT;
+		}
+		char buffer[4096];
+		ssize_t n = read(STDIN_FILENO, buffer, sizeof buffer);
+		if (n < 0) {
+			return errno == EINTR || errno == EAGAIN ? INTERRUPTED : CLOSED;
+		}
+		if (n == 0) {
+			return CLOSED;
+		}
+		input.erase(0, next);
+		next = 0;
+		input.append(buffer, n);
+		return FILLED;
+	}
+
+	// Takes everything up to the end-of-paste marker as `pasted`, however
+	// many reads it spans
+	void readPaste() {
+		static const string END = "\x1b[201~";
+		pasted.clear();
+		while (true) {
+			size_t found = input.find(END, next);
+			if (found != string::npos) {
+				pasted.append(input, next, found - next);
+				next = found + END.size();
+				return;
+			}
+			// Hold back what may be the start of the marker
+			size_t keep = min(input.size() - next, END.size() - 1);
+			pasted.append(input, next, input.size() - next - keep);
+			next = input.size() - keep;
+			if (fill(-1) == CLOSED) {
+				pasted.append(input, next, string::npos);
+				next = input.size();
+				return;
+			}
+		}
+	}
+
+	// Makes sure `count` bytes are buffered, waiting briefly for the rest
+	// of an escape sequence
+	bool have(size_t count) {
+		while (input.size() - next < count) {
+			if (fill(ESCAPE_WAIT_MS) != FILLED) return false;
+		}
+		return true;
+	}
+
+	// Decodes what follows an ESC: CSI ("ESC [") and SS3 ("ESC O")
+	// sequences. A lone ESC is the Escape key.
+	int decodeEscape() {
+		if (!have(1) || (input[next] != '[' && input[next] != 'O')) {
+			return 27;
+		}
+		bool ss3 = input[next++] == 'O';
+		vector<int> parameters{ 0 };
+		while (true) {
+			if (!have(1)) return KEY_UNKNOWN;
+			char c = input[next++];
+			if (c >= '0' && c <= '9') {
+				parameters.back() = parameters.back() * 10 + (c - '0');
+			}
+			else if (c == ';') {
+				parameters.push_back(0);
+			}
+			else if (c >= 0x40 && c <= 0x7E) {
+				if (c == '~' && parameters[0] == 200) {
+					readPaste();
+					return KEY_PASTE;
 				}
-				Cursor = temp;
-				break;
+				return decodeFinal(c, parameters[0], ss3);
+			}
+			else if (c < 0x20 || c > 0x3F) {
+				return KEY_UNKNOWN;     // Not a sequence after all
 			}
 		}
 	}
-	void moveToPreviousWord() {
-		if (!Cursor && current_line > 0) {
-			current_line--;
-			Cursor = lines[current_line];
-			moveToEndOfLine();
-			return;
+	static int decodeFinal(char final, int parameter, bool ss3) {
+		switch (final) {
+		case 'A': return KEY_UP;
+		case 'B': return KEY_DOWN;
+		case 'C': return KEY_RIGHT;
+		case 'D': return KEY_LEFT;
+		case 'H': return KEY_HOME;
+		case 'F': return KEY_END;
+		case 'P': case 'Q': case 'R': case 'S':
+			return ss3 || parameter == 1 ? KEY_F1 + (final - 'P') : KEY_UNKNOWN;
+		case '~':
+			switch (parameter) {
+			case 1: case 7: return KEY_HOME;
+			case 4: case 8: return KEY_END;
+			case 2: return KEY_INSERT;
+			case 3: return KEY_DELETE;
+			case 5: return KEY_PAGE_UP;
+			case 6: return KEY_PAGE_DOWN;
+			case 11: case 12: case 13: case 14: case 15:
+				return KEY_F1 + (parameter - 11);
+			case 17: case 18: case 19: case 20: case 21:
+				return KEY_F1 + 5 + (parameter - 17);
+			case 23: case 24:
+				return KEY_F1 + 10 + (parameter - 23);
+			}
+			return KEY_UNKNOWN;
 		}
+		return KEY_UNKNOWN;
+	}
+#endif
 
-		node* temp = Cursor;
+	// Next key from the keyboard
+	int readInput() {
+#ifdef _WIN32
+		int ch = _getch();
+		if (ch == 0 || ch == 224) {  // Check for special keys
+			ch = _getch();  // Get the second byte
+			switch (ch) {
+			case 72: return KEY_UP;
+			case 80: return KEY_DOWN;
+			case 77: return KEY_RIGHT;
+			case 75: return KEY_LEFT;
+			case 71: return KEY_HOME;
+			case 79: return KEY_END;
+			case 73: return KEY_PAGE_UP;
+			case 81: return KEY_PAGE_DOWN;
+			case 82: return KEY_INSERT;
+			case 83: return KEY_DELETE;
+			default: return KEY_UNKNOWN;
+			}
+		}
+		return ch == '\r' ? '\n' : ch;
+#elif defined(linux) || defined(APPLE)
+		while (next == input.size()) {
+			Fill result = fill(-1);
+			if (result == INTERRUPTED) return KEY_RESIZE;
+			if (result == CLOSED) return KEY_EOF;
+		}
+		unsigned char c = input[next++];
+		return c == 27 ? decodeEscape() : c;
+#endif
+	}
 
-		while (true) {
-			if (!temp->previous) {
-				if (current_line > 0) {
-					current_line--;
-					Cursor = lines[current_line];
-					moveToEndOfLine();
-					return;
+public:
+	Terminal() : next(0), recording(false) {
+#if defined(linux) || defined(APPLE)
+		if (tcgetattr(STDIN_FILENO, &saved) == 0) {
+			enterRaw();
+			atexit(restore);
+			for (int fatal : { SIGINT, SIGTERM, SIGHUP, SIGQUIT }) {
+				signal(fatal, onFatalSignal);
+			}
+			signal(SIGCONT, onContinue);
+		}
+#endif
+	}
+	Terminal(const Terminal&) = delete;
+	Terminal& operator=(const Terminal&) = delete;
+	~Terminal() {
+#if defined(linux) || defined(APPLE)
+		restore();
+#endif
+	}
+
+	// Next key: a byte, or one of Key. Keys of a macro being replayed come
+	// before any input.
+	int readKey() {
+		if (!playing.empty()) {
+			return replayKey();
+		}
+		int key = readInput();
+		if (recording && key != KEY_RESIZE && key != KEY_UNKNOWN && key != KEY_EOF) {
+			recorded.push_back(key);
+			if (key == KEY_PASTE) {
+				recorded.push_back(static_cast<int>(pasted.size()));
+				for (char c : pasted) {
+					recorded.push_back(static_cast<unsigned char>(c));
 				}
-				return;
 			}
-			while (temp->previous && (temp->data == ' ' || isPunctuation(temp->data))) {
-				temp = temp->previous;
+		}
+		return key;
+	}
+
+	// Keys as text, for a register: bytes stand for themselves, and other
+	// keys (and the byte ESCAPE_KEY) are ESCAPE_KEY followed by the key as a
+	// varint, so text yanked into a register can be replayed as keys too.
+	static string keysToText(const vector<int>& keys) {
+		string text;
+		for (int key : keys) {
+			if (key < 0x100 && key != ESCAPE_KEY) {
+				text += static_cast<char>(key);
 			}
-			while (temp->previous && isWordCharacter(temp->data)) {
-				temp = temp->previous;
+			else {
+				text += static_cast<char>(ESCAPE_KEY);
+				putVarint(text, key);
 			}
-			if (!isWordCharacter(temp->data) && temp->next) {
-				temp = temp->next;
+		}
+		return text;
+	}
+	static vector<int> keysFromText(const string& text) {
+		vector<int> keys;
+		const char* p = text.data();
+		const char* end = p + text.size();
+		while (p < end) {
+			int key = static_cast<unsigned char>(*p++);
+			uint64_t escaped;
+			if (key == ESCAPE_KEY && getVarint(p, end, escaped)) {
+				key = static_cast<int>(escaped);
 			}
-			Cursor = temp;
-			return;
+			keys.push_back(key);
 		}
+		return keys;
 	}
 
-
-	void moveToWordEnd() {
-		if (!Cursor || !Cursor->next) {
-			return;
+	// Starts keeping the keys typed from now on
+	void startRecording() {
+		recorded.clear();
+		recording = true;
+	}
+	// Stops recording and hands over the keys, less the one that stopped it
+	vector<int> stopRecording() {
+		recording = false;
+		if (!recorded.empty()) {
+			recorded.pop_back();
 		}
-		auto temp = Cursor;
-		while (temp->next && isPunctuation(temp->next->data)) {
-			temp = temp->next;
+		return move(recorded);
+	}
+	bool isRecording() const {
+		return recording;
+	}
+	// Has readKey() go through `keys` `times` over before reading input.
+	// False when macros are nested too deep to carry on.
+	bool play(const vector<int>& keys, size_t times) {
+		if (playing.size() >= MAX_PLAYBACK_DEPTH) {
+			playing.clear();
+			return false;
 		}
-		while (temp->next && isWordCharacter(temp->next->data)) {
-			temp = temp->next;
+		if (!keys.empty() && times > 0) {
+			playing.push_back(Playback{ keys, 0, times });
 		}
-		Cursor = temp;
+		return true;
 	}
-	void updateStatus(const string& lastCommand = "") {
-		status.currentMode = insertMode ? "INSERT" : "NORMAL";
-		status.cursorLine = current_line + 1;
-		status.cursorColumn = getCursorColumn();
-		status.totalLines = lines.size();
-		if (!lastCommand.empty()) {
-			status.lastCommand = lastCommand;
-		}
+	bool replaying() const {
+		return !playing.empty();
 	}
-	size_t getCursorColumn() {
-		size_t column = 0;
-		auto temp = lines[current_line];
-		while (temp && temp != Cursor) {
-			column++;
-			temp = temp->next;
-		}
-		return column + 1;
+	// Drops the rest of every macro being replayed
+	void stopReplay() {
+		playing.clear();
 	}
 
+	// Text of the last KEY_PASTE
+	const string& pastedText() const {
+		return pasted;
+	}
 
-	void display() {
-#ifdef _WIN32
-		system("cls");
-#else
-		system("clear");
-#endif
-		cout << "---------------------------------\n";
-		for (int i = 0; i < lines.size(); i++) {
-			cout << i + 1 << "|";
-			node* temp = lines[i];
-			while (temp != nullptr) {
-				if (i == current_line && Cursor == temp) {
-					cout << "|";
+	// Reads a line after `prompt` on the current row, with Backspace to
+	// edit it. False when it was cancelled with Escape (or by erasing past
+	// its start) or input ended. Nothing is echoed while a macro supplies
+	// the keys.
+	bool readLine(const string& prompt, string& line) {
+		line.clear();
+		if (!replaying()) {
+			cout << prompt << flush;
+		}
+		while (true) {
+			bool echo = !replaying();
+			int key = readKey();
+			if (key == '\n' || key == '\r') {
+				return true;
+			}
+			if (key == 27 || key == KEY_EOF) {
+				line.clear();
+				return false;
+			}
+			if (key == 8 || key == 127) {
+				if (line.empty()) return false;
+				while (line.size() > 1 && Screen::continuation(line.back())) {
+					line.pop_back();
 				}
-				cout << temp->data;
-				temp = temp->next;
+				line.pop_back();
+				if (echo) cout << "\b \b" << flush;
 			}
-			if (i == current_line && Cursor == nullptr) {
-				cout << "|";
+			else if (key == '\t' || (key >= 0x20 && key < 0x100 && key != 127)) {
+				line += static_cast<char>(key);
+				if (echo) cout << static_cast<char>(key) << flush;
 			}
-			cout << endl;
 		}
-		cout << "---------------------------------\n";
-
-		cout << "Mode: " << status.currentMode
-			<< " | File: " << fileManager.getCurrentFileName()
-			<< (fileManager.hasUnsavedChanges() ? " [+]" : "")
-			<< " | Line: " << status.cursorLine << "/" << status.totalLines
-			<< " | Column: " << status.cursorColumn
-			<< " | Last: " << status.lastCommand << endl;
 	}
+};
+// Scripted runs: ex commands given with -c, or one per line of a -s file,
+// are run in order on every file named, without the terminal. Files are
+// edited in parallel. The exit status is 0 when every command succeeded, 1
+// when one failed or a file was left with unsaved changes, and 2 when an
+// argument, script or file could not be used.
+static constexpr int EXIT_COMMAND_FAILED = 1;
+static constexpr int EXIT_BAD_INPUT = 2;
 
-	class Iterator {
-		node* current;
+struct ScriptLine {
+	string command;
+	string source;      // "-c" or script:line, for messages
+};
 
-	public:
-		Iterator(node* ptr) : current(ptr) {}
+// Runs the script on one file, or on an empty buffer for an empty name.
+// Problems are described in `report`.
+static int runScript(const vector<ScriptLine>& script, const string& filename, string& report) {
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.useSearchIndex(false);   // The script searches once or twice at most
+	string name = filename.empty() ? "[No Name]" : filename;
+	if (!filename.empty() && !editor.loadFromFile(filename)) {
+		report = name + ": cannot read the file\n";
+		return EXIT_BAD_INPUT;
+	}
+	for (const ScriptLine& line : script) {
+		// The ':' is optional; '"' starts a comment
+		size_t start = line.command.find_first_not_of(" \t:");
+		if (start == string::npos || line.command[start] == '"') continue;
+		string cmd = line.command.substr(start);
+		while (!cmd.empty() && (cmd.back() == ' ' || cmd.back() == '\t' || cmd.back() == '\r')) {
+			cmd.pop_back();
+		}
 
-		char operator*() const {
-			return current->data;
+		string argument;
+		size_t space = cmd.find(' ');
+		string word = cmd.substr(0, space);
+		if (space != string::npos && (word == "w" || word == "wq" || word == "x" || word == "r")) {
+			argument = cmd.substr(cmd.find_first_not_of(' ', space));
+			cmd = word;
 		}
 
-		Iterator& operator++() {
-			if (current != nullptr && current->next != nullptr) {
-				current = current->next;
+		bool quit = false;
+		if (cmd == "w" || cmd == "wq" || cmd == "x") {
+			string target = argument.empty() ? editor.getFileName() : argument;
+			if (target.empty()) {
+				editor.fail("No file name");
 			}
-			return *this;
+			else if (cmd != "x" || editor.hasUnsavedChanges() || !argument.empty()) {
+				editor.saveToFile(target);
+			}
+			quit = cmd != "w";
 		}
-
-		Iterator& operator--() {
-			if (current != nullptr && current->previous != nullptr) {
-				current = current->previous;
+		else if (cmd == "q") {
+			if (editor.hasUnsavedChanges()) {
+				editor.fail("Unsaved changes; use wq or q!");
 			}
-			return *this;
+			quit = true;
 		}
-
-		bool operator==(const Iterator& other) const {
-			return current == other.current;
+		else if (cmd == "q!") {
+			return 0;
 		}
-
-		bool operator!=(const Iterator& other) const {
-			return current != other.current;
+		else if (cmd == "r") {
+			if (argument.empty()) {
+				editor.fail("No file name");
+			}
+			else {
+				editor.readIntoText(argument);
+			}
 		}
-
-		node* getNode() const {
-			return current;
+		else if (cmd[0] == '/') {
+			editor.search(cmd.substr(1));
+		}
+		else if (!editor.exCommand(cmd)) {
+			editor.fail("Not an editor command: " + cmd);
 		}
-	};
-
-};
 
+		if (editor.takeFailure()) {
+			report = name + ": " + line.source + ": " + editor.statusMessage() + "\n";
+			return EXIT_COMMAND_FAILED;
+		}
+		if (quit) {
+			return 0;
+		}
+	}
+	if (editor.hasUnsavedChanges()) {
+		report = name + ": unsaved changes at the end of the script; end it with wq or q!\n";
+		return EXIT_COMMAND_FAILED;
+	}
+	return 0;
+}
 
-class CommandMode {
+// Runs the script on every file, a thread per core, and reports problems in
+// the order the files were given
+static int runBatch(const vector<ScriptLine>& script, vector<string> files) {
+	if (files.empty()) {
+		files.push_back("");
+	}
+	// Two threads must not edit one file
+	vector<string> unique;
+	for (const string& file : files) {
+		if (find(unique.begin(), unique.end(), file) == unique.end()) unique.push_back(file);
+	}
+	files.swap(unique);
 
-public:    vector<string> commandHistory;    int index = -1;
-	  void addCommandToHistory(const string& command) {
-		  commandHistory.push_back(command);
-		  index = commandHistory.size();
-	  }
+	vector<int> results(files.size(), 0);
+	vector<string> reports(files.size());
+	size_t threads = min<size_t>(files.size(), max(1u, thread::hardware_concurrency()));
+	ThreadPool pool(threads - 1);   // The calling thread takes files too
+	pool.parallelFor(files.size(), [&](size_t i) {
+		results[i] = runScript(script, files[i], reports[i]);
+		});
+	int status = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		cerr << reports[i];
+		status = max(status, results[i]);
+	}
+	return status;
+}
 
-	  string getPreviousCommand() {
-		  if (index > 0) {
-			  index--;
-			  return commandHistory[index];
-		  }
-		  return "";
-	  }
+static void printUsage(const char* program) {
+	cerr << "Usage: " << program << " [file...]" << endl
+		<< "       " << program << " {-c command | -s script}... [file...]" << endl;
+}
 
-	  string getNextCommand() {
-		  if (index < commandHistory.size() - 1) {
-			  index++;
-			  return commandHistory[index];
-		  }
-		  return "";
-	  }
-};
-int getChar() {
-#ifdef _WIN32
-	int ch = _getch();
-	if (ch == 0 || ch == 224) {  // Check for special keys
-		ch = _getch();  // Get the second byte
-		switch (ch) {
-		case 72: return 65;  // Up arrow
-		case 80: return 66;  // Down arrow
-		case 77: return 67;  // Right arrow
-		case 75: return 68;  // Left arrow
-		default: return ch + 256;  // Other special keys
-		}
-	}
-	return ch;
-#elif defined(linux) || defined(APPLE)
-	struct termios old_tio, new_tio;
-	int c;
-
-	tcgetattr(STDIN_FILENO, &old_tio);
-	new_tio = old_tio;
-	new_tio.c_lflag &= (~ICANON & ~ECHO);
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-
-	c = getchar();
-	if (c == 27) {  // ESC
-		c = getchar();
-		if (c == 91) {  // [
-			c = getchar();
-			switch (c) {
-			case 65: c = 65; break;  // Up arrow
-			case 66: c = 66; break;  // Down arrow
-			case 67: c = 67; break;  // Right arrow
-			case 68: c = 68; break;  // Left arrow
-			default: c += 128;  // Other special keys
+int main(int argc, char* argv[]) {
+	vector<ScriptLine> script;
+	vector<string> files;
+	bool scripted = false;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "-c" || arg == "-s") {
+			if (i + 1 == argc) {
+				printUsage(argv[0]);
+				return EXIT_BAD_INPUT;
+			}
+			scripted = true;
+			string value = argv[++i];
+			if (arg == "-c") {
+				script.push_back(ScriptLine{ value, "-c " + value });
+				continue;
 			}
+			string content;
+			if (!FileManager::readFile(value, content)) {
+				cerr << value << ": cannot read the script" << endl;
+				return EXIT_BAD_INPUT;
+			}
+			istringstream lines(content);
+			string line;
+			for (size_t number = 1; getline(lines, line); ++number) {
+				script.push_back(ScriptLine{ line, value + ":" + to_string(number) });
+			}
+		}
+		else if (arg == "--") {
+			files.insert(files.end(), argv + i + 1, argv + argc);
+			break;
+		}
+		else if (arg.size() > 1 && arg[0] == '-') {
+			printUsage(argv[0]);
+			return EXIT_BAD_INPUT;
 		}
 		else {
-			ungetc(c, stdin);
-			c = 27;
+			files.push_back(arg);
 		}
 	}
+	if (scripted) {
+		return runBatch(script, files);
+	}
 
-	tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
-	return c;
-#endif
-}
-// Platform-specific getChar() remains the same
-int main() {
-	TextEditor editor;
+	Terminal terminal;
+	BufferList buffers;
+	for (const string& file : files) {
+		buffers.open(file);
+	}
+	if (buffers.size() > 1) {
+		buffers.show(0);
+	}
 	int command;
-	char previousKey = '\0';
 	string lastSearchPattern;
 	int count = 0; // To handle number prefixes
+	char registerName = Registers::UNNAMED;     // Given as "x before a command
 	CommandMode cmd22;
+	int lastMacro = 0;              // Register @@ replays
+	int lastRecorded = 0;           // Register being recorded into
 
 	while (true) {
-		editor.display();
-		command = getChar();
+		TextEditor& editor = buffers.current();
+		// A failed command ends any macro, and the screen is only drawn
+		// once a macro is done
+		if (editor.takeFailure()) {
+			terminal.stopReplay();
+		}
+		if (!terminal.replaying()) {
+			editor.display();
+		}
+		command = terminal.readKey();
+		if (command == KEY_EOF) {
+			break;
+		}
+		if (command == KEY_RESIZE || command == KEY_UNKNOWN) {
+			continue;   // Redraw, at the new size if it changed
+		}
+		if (command == KEY_PASTE) {
+			editor.paste(terminal.pastedText());
+			cmd22.addCommandToHistory("Paste");
+			continue;
+		}
+		if (!editor.isInsertMode()) {
+			editor.sealUndoStep();
+		}
 
-		// Check for number prefix
-		if (isdigit(command)) {
+		// A register may be named first, as in "a3yy
+		registerName = Registers::UNNAMED;
+		if (!editor.isInsertMode() && command == '"') {
+			int name = terminal.readKey();
+			if (!Registers::isName(name)) {
+				continue;
+			}
+			registerName = static_cast<char>(name);
+			command = terminal.readKey();
+			if (command == KEY_EOF) {
+				break;
+			}
+		}
+
+		// Check for number prefix; the key after it is the command
+		count = 0;
+		if (!editor.isInsertMode() && command < 0x100 && isdigit(command) && command != '0') {
 			count = command - '0'; // Convert char to int
-			while (isdigit(command = getChar())) {
+			while ((command = terminal.readKey()) < 0x100 && isdigit(command)) {
 				count = count * 10 + (command - '0'); // Build the full number
 			}
+			if (command == KEY_EOF) {
+				break;
+			}
 		}
-		else {
-			// Handle commands based on the current mode
-			if (!editor.isInsertMode()) {
-				if (command == ':') {
-					string cmd;
-					cout << ":";
-					cin >> cmd;
-
-					if (cmd == "w") {
-						string filename = editor.getFileName();
-						if (filename.empty()) {
-							cout << "Enter filename to save: ";
-							cin >> filename;
-						}
+		// Handle commands based on the current mode
+		if (!editor.isInsertMode()) {
+			if (command == 'q') {
+				if (terminal.isRecording()) {
+					string keys = Terminal::keysToText(terminal.stopRecording());
+					editor.getRegisters().recorded(static_cast<char>(lastRecorded), make_shared<const string>(move(keys)));
+					editor.updateStatus("Recorded @" + string(1, static_cast<char>(lastRecorded)));
+					cmd22.addCommandToHistory("Stop Recording");
+				}
+				else {
+					int name = terminal.readKey();
+					if (name < 0x100 && isalnum(name)) {
+						lastRecorded = name;
+						terminal.startRecording();
+						editor.updateStatus("Recording @" + string(1, static_cast<char>(name)));
+						cmd22.addCommandToHistory("Record @" + string(1, static_cast<char>(name)));
+					}
+				}
+			}
+			else if (command == '@') {
+				int name = terminal.readKey();
+				if (name == '@') {
+					name = lastMacro;
+				}
+				Registers::Text macro = Registers::isName(name) ? editor.getRegisters().get(static_cast<char>(name)) : nullptr;
+				if (!macro || macro->empty()) {
+					editor.fail("Nothing recorded in that register");
+				}
+				else if (!terminal.play(Terminal::keysFromText(*macro), max(count, 1))) {
+					editor.fail("Macros nested too deep");
+				}
+				else {
+					lastMacro = name;
+					cmd22.addCommandToHistory("@" + string(1, static_cast<char>(name)));
+				}
+			}
+			else if (command == ':') {
+				string cmd;
+				editor.openCommandLine();
+				terminal.readLine(":", cmd);
+
+				// ":w", ":wq", ":e" and ":r" may name the file
+				string argument;
+				size_t space = cmd.find(' ');
+				string name = cmd.substr(0, space);
+				if (space != string::npos && (name == "w" || name == "wq" || name == "e" || name == "r")) {
+					size_t start = cmd.find_first_not_of(' ', space);
+					argument = start == string::npos ? "" : cmd.substr(start);
+					cmd = name;
+				}
+
+				if (cmd == "w") {
+					string filename = argument.empty() ? editor.getFileName() : argument;
+					if (filename.empty()) {
+						editor.openCommandLine();
+						terminal.readLine("Enter filename to save: ", filename);
+					}
+					if (!filename.empty()) {
 						editor.saveToFile(filename);
-						cmd22.addCommandToHistory(":w");
 					}
-					else if (cmd == "wq") {
-						string filename = editor.getFileName();
-						if (filename.empty()) {
-							cout << "Enter filename to save: ";
-							cin >> filename;
-						}
+					cmd22.addCommandToHistory(":w");
+				}
+				else if (cmd == "wq") {
+					string filename = argument.empty() ? editor.getFileName() : argument;
+					if (filename.empty()) {
+						editor.openCommandLine();
+						terminal.readLine("Enter filename to save: ", filename);
+					}
+					if (!filename.empty()) {
 						editor.saveToFile(filename);
-						cmd22.addCommandToHistory(":wq");
+					}
+					cmd22.addCommandToHistory(":wq");
+					if (buffers.unsaved() < 0) {
 						break;
 					}
-					else if (cmd == "q") {
-						if (editor.hasUnsavedChanges()) {
-							cout << "Unsaved changes! Use :q! to force quit.\n";
-						}
-						else {
-							break;
-						}
+					editor.updateStatus("Buffer " + to_string(buffers.unsaved() + 1) + " has unsaved changes! Use :q! to force quit.");
+				}
+				else if (cmd == "q") {
+					if (editor.hasUnsavedChanges()) {
+						editor.updateStatus("Unsaved changes! Use :q! to force quit.");
+					}
+					else if (buffers.unsaved() >= 0) {
+						editor.updateStatus("Buffer " + to_string(buffers.unsaved() + 1) + " has unsaved changes! Use :q! to force quit.");
 					}
-					else if (cmd == "q!") {
-						cmd22.addCommandToHistory(":q!");
+					else {
 						break;
 					}
-					else if (cmd == "e") {
-						string filename;
-						cout << "Enter filename to open: ";
-						cin >> filename;
-						editor.loadFromFile(filename);
-						cmd22.addCommandToHistory(":e " + filename);
+				}
+				else if (cmd == "q!") {
+					cmd22.addCommandToHistory(":q!");
+					break;
+				}
+				else if (cmd == "e") {
+					string filename = argument;
+					if (filename.empty()) {
+						editor.openCommandLine();
+						terminal.readLine("Enter filename to open: ", filename);
 					}
-					else if (cmd.substr(0, 2) == "s/") {
-						// Handle replace commands
-						string replaceCmd = cmd.substr(2); // Strip "s/"
-						size_t firstSlash = replaceCmd.find('/');
-						size_t secondSlash = replaceCmd.rfind('/');
-
-						if (firstSlash != string::npos && secondSlash != string::npos && firstSlash != secondSlash) {
-							string oldText = replaceCmd.substr(0, firstSlash);
-							string newText = replaceCmd.substr(firstSlash + 1, secondSlash - firstSlash - 1);
-							bool replaceAll = (replaceCmd.substr(secondSlash + 1) == "g");
-
-							if (replaceAll) {
-								editor.replaceAll(oldText, newText);
-							}
-							else {
-								editor.replaceFirst(oldText, newText);
-							}
-							cmd22.addCommandToHistory(":s/" + oldText + "/" + newText + (replaceAll ? "/g" : ""));
-						}
-						else {
-							cout << "Invalid replace command. Use :s/old/new or :s/old/new/g.\n";
-						}
+					if (!filename.empty()) {
+						buffers.open(filename);
 					}
+					cmd22.addCommandToHistory(":e " + filename);
 				}
-				else if (command == '/') {
-					string pattern;
-					cout << "/";
-					cin >> pattern;
-					lastSearchPattern = pattern;
-					editor.search(pattern);
-					cmd22.addCommandToHistory("/" + pattern);
-				}
-				else if (command == 'n') {
-					if (!lastSearchPattern.empty()) {
-						editor.findNext();
-						cmd22.addCommandToHistory("n");
+				else if (cmd == "bn" || cmd == "bp") {
+					if (cmd == "bn") {
+						buffers.next();
 					}
 					else {
-						cout << "No previous search pattern. Use /pattern first.\n";
+						buffers.previous();
 					}
+					cmd22.addCommandToHistory(":" + cmd);
 				}
-				else if (command == 'N') {
-					if (!lastSearchPattern.empty()) {
-						editor.findPrevious();
-						cmd22.addCommandToHistory("N");
+				else if (cmd == "bd") {
+					if (buffers.close()) {
+						cmd22.addCommandToHistory(":bd");
+						continue;   // `editor` was the buffer closed
 					}
 					else {
-						cout << "No previous search pattern. Use /pattern first.\n";
+						editor.fail("Unsaved changes! Save them before closing the buffer.");
 					}
 				}
-				else if (command == 'd' || command == 'y' || command == 'j' || command == '>' || command == '<') {
-					string cmd;
-					switch (command) {
-					case 'd':
-						cmd = "dd";
-						break;
-					case 'y':
-						cmd = "yy";
-						break;
-					case 'j':
-						cmd = "j";
-						break;
-					case '>':
-						cmd = ">>";
-						break;
-					case '<':
-						cmd = "<<";
-						break;
+				else if (cmd == "ls") {
+					cout << "\x1b[H\x1b[2J";
+					for (const string& line : buffers.list()) {
+						cout << line << endl;
+					}
+					cout << "Press a key to continue" << flush;
+					terminal.readKey();
+					editor.redrawScreen();
+					cmd22.addCommandToHistory(":ls");
+				}
+				else if (cmd == "r") {
+					string filename = argument;
+					if (filename.empty()) {
+						editor.openCommandLine();
+						terminal.readLine("Enter filename to read: ", filename);
 					}
-					editor.executeWithCount(count, cmd);
-					cmd22.addCommandToHistory(cmd + to_string(count)); // Add command to history with count
-					count = 0; // Reset count after execution
+					if (!filename.empty()) {
+						editor.readIntoText(filename);
+						cmd22.addCommandToHistory(":r " + filename);
+					}
+				}
+				else if (editor.exCommand(cmd)) {
+					cmd22.addCommandToHistory(":" + cmd);
+				}
+				else if (!cmd.empty()) {
+					editor.fail("Not an editor command: " + cmd);
 				}
 			}
-
-			if (command == 27) { // Escape key to exit insert mode
-				editor.exitInsertMode();
-				previousKey = '\0';
-				editor.updateStatus("Exit Insert Mode");
-				cmd22.addCommandToHistory("Exit Insert Mode");
-				continue;
+			else if (command == '/') {
+				string pattern;
+				editor.openCommandLine();
+				if (!terminal.readLine("/", pattern) || pattern.empty()) {
+					continue;
+				}
+				lastSearchPattern = pattern;
+				editor.search(pattern);
+				cmd22.addCommandToHistory("/" + pattern);
 			}
-
-			auto isArrowKey = [](int key) -> bool {
-				return key == 65 || key == 66 || key == 67 || key == 68;
-				};
-
-			if (editor.isInsertMode()) {
-				if (isArrowKey(command)) {
-					switch (command) {
-					case 65: editor.moveUp(); break;
-					case 66: editor.moveDown(); break;
-					case 67: editor.moveRight(); break;
-					case 68: editor.moveLeft(); break;
-					}
-					editor.updateStatus("Arrow Key");
-					cmd22.addCommandToHistory("Arrow Key");
+			else if (command == 'n') {
+				if (!lastSearchPattern.empty()) {
+					editor.findNext();
+					cmd22.addCommandToHistory("n");
+				}
+				else {
+					editor.updateStatus("No previous search pattern. Use /pattern first.");
 				}
-				else if (command == 8 || command == 127) { // Handle backspace
-					editor.backspace();
-					editor.updateStatus("Backspace");
-					cmd22.addCommandToHistory("Backspace");
+			}
+			else if (command == 'N') {
+				if (!lastSearchPattern.empty()) {
+					editor.findPrevious();
+					cmd22.addCommandToHistory("N");
 				}
 				else {
-					editor.insert(static_cast<char>(command));
-					cmd22.addCommandToHistory(string(1, static_cast<char>(command)));
+					editor.updateStatus("No previous search pattern. Use /pattern first.");
 				}
 			}
-			else { // Normal mode
+			else if (command == 'd' || command == 'y' || command == 'j' || command == '>' || command == '<') {
+				// dd, yy, >> and << are typed twice; anything else as the
+				// second key cancels them
+				if (command != 'j' && terminal.readKey() != command) {
+					continue;
+				}
+				string cmd;
 				switch (command) {
-				case 'i': // Enter insert mode
-					editor.enterInsertMode();
-					editor.updateStatus("Enter Insert Mode");
-					cmd22.addCommandToHistory("Enter Insert Mode");
-					break;
-				case 'x':
-					editor.deleteCharacterAtCursor();
-					editor.updateStatus("Delete Char");
-					cmd22.addCommandToHistory("Delete Char");
+				case 'd':
+					cmd = "dd";
 					break;
 				case 'y':
-					if (previousKey == 'y') {
-						editor.yankLine();
-						editor.updateStatus("Yank Line");
-						cmd22.addCommandToHistory("Yank Line");
-						previousKey = '\0';
-					}
-					else {
-						previousKey = 'y';
-					}
+					cmd = "yy";
 					break;
-				case 'p':
-					editor.pasteAfter();
-					editor.updateStatus("Paste After");
-					cmd22.addCommandToHistory("Paste After");
+				case 'j':
+					cmd = "j";
 					break;
-				case 'P':
-					editor.pasteBefore();
-					editor.updateStatus("Paste Before");
-					cmd22.addCommandToHistory("Paste Before");
+				case '>':
+					cmd = ">>";
 					break;
-				case 'M':
-				{
-					cout << "Showing command history :" << endl;
-					while (true) {
-						system("cls");
-						cout << "Showing command history:" << endl;
-
-						for (size_t i = 0; i < cmd22.commandHistory.size(); ++i) {
-							if (i == cmd22.index) {
-								cout << "> " << cmd22.commandHistory[i] << " <" << endl;
-							}
-							else {
-								cout << "  " << cmd22.commandHistory[i] << endl;
-							}
-						}
+				case '<':
+					cmd = "<<";
+					break;
+				}
+				editor.executeWithCount(count, cmd, registerName);
+				cmd22.addCommandToHistory(count > 0 ? to_string(count) + cmd : cmd);
+			}
+		}
 
-						int cmd1 = getChar();
+		if (command == 27) { // Escape key to exit insert mode
+			editor.exitInsertMode();
+			editor.updateStatus("Exit Insert Mode");
+			cmd22.addCommandToHistory("Exit Insert Mode");
+			continue;
+		}
 
-						if (cmd1 == 65) {
-							cmd22.getPreviousCommand();
-						}
-						else if (cmd1 == 66) {
-							cmd22.getNextCommand();
-						}
-						else if (cmd1 == 13) {
-							string selectedCommand = cmd22.commandHistory[cmd22.index];
-							cout << "Selected command: " << selectedCommand << endl;
+		// Arrows, Home and End move the cursor in either mode
+		auto moveKey = [&](int key) -> bool {
+			switch (key) {
+			case KEY_UP: editor.moveUp(); break;
+			case KEY_DOWN: editor.moveDown(); break;
+			case KEY_RIGHT: editor.moveRight(); break;
+			case KEY_LEFT: editor.moveLeft(); break;
+			case KEY_HOME: editor.moveToStartOfLine(); break;
+			case KEY_END: editor.moveToEndOfLine(); break;
+			default: return false;
+			}
+			editor.updateStatus("Arrow Key");
+			cmd22.addCommandToHistory("Arrow Key");
+			return true;
+			};
 
-							break;
-						}
-						else if (cmd1 == 27) {
-							break;
-						}
-					}
+		if (editor.isInsertMode()) {
+			if (command == 8 || command == 127) { // Handle backspace
+				editor.backspace();
+				editor.updateStatus("Backspace");
+				cmd22.addCommandToHistory("Backspace");
+			}
+			else if (command < 0x100) {
+				editor.insert(static_cast<char>(command));
+				cmd22.addCommandToHistory(string(1, static_cast<char>(command)));
+			}
+			else {
+				moveKey(command);
+			}
+		}
+		else { // Normal mode
+			switch (command) {
+			case 'i': // Enter insert mode
+				editor.enterInsertMode();
+				editor.updateStatus("Enter Insert Mode");
+				cmd22.addCommandToHistory("Enter Insert Mode");
+				break;
+			case 'x':
+				editor.deleteCharacterAtCursor();
+				editor.updateStatus("Delete Char");
+				cmd22.addCommandToHistory("Delete Char");
+				break;
+			case 'u':
+				editor.undo();
+				cmd22.addCommandToHistory("Undo");
+				break;
+			case 18: // Ctrl-R
+				editor.redo();
+				cmd22.addCommandToHistory("Redo");
+				break;
+			case 6: // Ctrl-F
+			case 2: // Ctrl-B
+				editor.scrollPage(command == 6);
+				cmd22.addCommandToHistory(command == 6 ? "Page Down" : "Page Up");
+				break;
+			case 4: // Ctrl-D
+			case 21: // Ctrl-U
+				editor.scrollHalfPage(command == 4);
+				cmd22.addCommandToHistory(command == 4 ? "Half Page Down" : "Half Page Up");
+				break;
+			case 'z':
+				if (terminal.readKey() == 'z') {
+					editor.centerCursorLine();
+					cmd22.addCommandToHistory("Center Line");
 				}
 				break;
-				case 'n':
-					editor.newLine();
-					editor.updateStatus("New Line");
-					cmd22.addCommandToHistory("New Line");
-					break;
-				case '0':
-					editor.moveToStartOfLine();
-					editor.updateStatus("Move to Start of Line");
-					cmd22.addCommandToHistory("Move to Start of Line");
-					break;
-				case '$':
-					editor.moveToEndOfLine();
-					editor.updateStatus("Move to End of Line");
-					cmd22.addCommandToHistory("Move to End of Line");
-					break;
-				case 'w':
-					editor.moveToNextWord();
-					editor.updateStatus("Move to Next Word");
-					cmd22.addCommandToHistory("Move to Next Word");
-					break;
-				case 'b':
-					editor.moveToPreviousWord();
-					editor.updateStatus("Move to Previous Word");
-					cmd22.addCommandToHistory("Move to Previous Word");
-					break;
-				default:
-					if (isArrowKey(command)) {
-						switch (command) {
-						case 65: editor.moveUp(); break;
-						case 66: editor.moveDown(); break;
-						case 67: editor.moveRight(); break;
-						case 68: editor.moveLeft(); break;
+			case 'g':
+			{
+				int next = terminal.readKey();
+				if (next == 'j' || next == 'k') {
+					editor.moveScreenRow(next == 'j');
+					cmd22.addCommandToHistory(next == 'j' ? "Row Down" : "Row Up");
+				}
+			}
+			break;
+			case 'p':
+				editor.pasteAfter(registerName);
+				cmd22.addCommandToHistory("Paste After");
+				break;
+			case 'P':
+				editor.pasteBefore(registerName);
+				cmd22.addCommandToHistory("Paste Before");
+				break;
+			case 'M':
+			{
+				cout << "Showing command history :" << endl;
+				while (true) {
+					cout << "\x1b[H\x1b[2J";
+					cout << "Showing command history:" << endl;
+
+					for (size_t i = 0; i < cmd22.commandHistory.size(); ++i) {
+						if (i == cmd22.index) {
+							cout << "> " << cmd22.commandHistory[i] << " <" << endl;
+						}
+						else {
+							cout << "  " << cmd22.commandHistory[i] << endl;
 						}
-						editor.updateStatus("Arrow Key");
-						cmd22.addCommandToHistory("Arrow Key");
 					}
-					break;
+
+					int cmd1 = terminal.readKey();
+
+					if (cmd1 == KEY_UP) {
+						cmd22.getPreviousCommand();
+					}
+					else if (cmd1 == KEY_DOWN) {
+						cmd22.getNextCommand();
+					}
+					else if (cmd1 == '\n' || cmd1 == '\r') {
+						string selectedCommand = cmd22.commandHistory[cmd22.index];
+						editor.updateStatus("Selected command: " + selectedCommand);
+
+						break;
+					}
+					else if (cmd1 == 27 || cmd1 == KEY_EOF) {
+						break;
+					}
 				}
+				editor.redrawScreen();
+			}
+			break;
+			case '0':
+				editor.moveToStartOfLine();
+				editor.updateStatus("Move to Start of Line");
+				cmd22.addCommandToHistory("Move to Start of Line");
+				break;
+			case '$':
+				editor.moveToEndOfLine();
+				editor.updateStatus("Move to End of Line");
+				cmd22.addCommandToHistory("Move to End of Line");
+				break;
+			case 'w':
+				editor.moveToNextWord();
+				editor.updateStatus("Move to Next Word");
+				cmd22.addCommandToHistory("Move to Next Word");
+				break;
+			case 'b':
+				editor.moveToPreviousWord();
+				editor.updateStatus("Move to Previous Word");
+				cmd22.addCommandToHistory("Move to Previous Word");
+				break;
+			case KEY_PAGE_DOWN:
+			case KEY_PAGE_UP:
+				editor.scrollPage(command == KEY_PAGE_DOWN);
+				cmd22.addCommandToHistory(command == KEY_PAGE_DOWN ? "Page Down" : "Page Up");
+				break;
+			case KEY_DELETE:
+				editor.deleteCharacterAtCursor();
+				editor.updateStatus("Delete Char");
+				cmd22.addCommandToHistory("Delete Char");
+				break;
+			default:
+				moveKey(command);
+				break;
 			}
 		}
 	}
@@ -0,0 +1,328 @@
+// Checks of TextEditor through its public interface. Build and run from the
+// repository root:
+//
+//   g++ -std=gnu++17 -O2 -o editor_test tests/editor_test.cpp -lpthread && ./editor_test
+//
+// The editor is a single translation unit, so it is included with its main()
+// renamed.
+#define main editorMain
+#include "../Vim_Editor.cpp"
+#undef main
+#include <sys/wait.h>
+
+static int failures = 0;
+
+static void check(bool ok, const string& what) {
+	if (!ok) {
+		cerr << "FAILED: " << what << endl;
+		failures++;
+	}
+}
+
+static string scratchFile(const string& name) {
+	return "/tmp/editor_test_" + to_string(getpid()) + "_" + name;
+}
+
+static void writeFile(const string& filename, const string& content) {
+	ofstream file(filename, ios::binary);
+	file << content;
+}
+
+// The text as it would be saved
+static string contentOf(TextEditor& editor) {
+	string filename = scratchFile("saved");
+	editor.saveToFile(filename);
+	string content;
+	FileManager::readFile(filename, content);
+	remove(filename.c_str());
+	return content;
+}
+
+static void testEnterSplitsLine() {
+	string filename = scratchFile("enter");
+	writeFile(filename, "xyz\n");
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.loadFromFile(filename);
+
+	// "xyz", i a b <Enter> c Esc x x
+	editor.enterInsertMode();
+	editor.insert('a');
+	editor.insert('b');
+	editor.insert('\n');
+	check(editor.getCursorLine() == 2, "Enter moves the cursor to the new line");
+	check(editor.countCharactersInLine(1) == 2, "the new line holds what followed the cursor");
+	editor.insert('c');
+	editor.exitInsertMode();
+	check(editor.getCursorLine() == 2 && editor.getCursorColumn() == 1, "typing after Enter continues on the new line");
+	editor.deleteCharacterAtCursor();
+	editor.deleteCharacterAtCursor();
+	check(contentOf(editor) == "xab\nz\n", "edits after Enter land on the new line");
+
+	// Enter at the end of a line, then typing and deleting there
+	editor.moveToEndOfLine();
+	editor.enterInsertMode();
+	editor.insert('\n');
+	editor.insert('q');
+	editor.insert('r');
+	editor.exitInsertMode();
+	editor.deleteCharacterAtCursor();
+	check(editor.getCursorLine() == 3 && editor.countCharactersInLine(2) == 1, "the line made by Enter is edited in place");
+	check(contentOf(editor) == "xab\nz\nq\n", "Enter at the end of a line opens an empty one");
+	remove(filename.c_str());
+}
+
+// Runs the editor on `filename` in `directory` with `keys` as its input,
+// which then ends, and gives back what it drew. Frames are 80 columns wide
+// when output is not a terminal, so the file name should be short.
+static string runKeys(const string& directory, const string& filename, const string& keys) {
+	string input = scratchFile("keys"), output = scratchFile("screen");
+	writeFile(input, keys);
+	pid_t child = fork();
+	if (child == 0) {
+		int in = open(input.c_str(), O_RDONLY);
+		int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (in < 0 || out < 0 || chdir(directory.c_str()) != 0) _exit(127);
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		char program[] = "editor";
+		string name = filename;
+		char* argv[] = { program, &name[0], nullptr };
+		cout.flush();
+		_exit(editorMain(2, argv));
+	}
+	int status;
+	waitpid(child, &status, 0);
+	string screen;
+	FileManager::readFile(output, screen);
+	remove(input.c_str());
+	remove(output.c_str());
+	return screen;
+}
+
+static void testFindNextKeepsText() {
+	string directory = scratchFile("search");
+	mkdir(directory.c_str(), 0700);
+	string filename = directory + "/s.txt";
+	string content = "foo\nbar foo\nfoo baz\nend\n";
+	writeFile(filename, content);
+
+	// Search, then n twice: the cursor goes through the matches in order
+	string screen = runKeys(directory, "s.txt", "/foo\rnn:w t.txt\r");
+	string copy = directory + "/t.txt";
+	string saved;
+	FileManager::readFile(copy, saved);
+	check(saved == content, "n moves to the next match without editing");
+	check(screen.find("Match 2 of 3") != string::npos && screen.find("Match 3 of 3") != string::npos, "n shows which match the cursor is on");
+	remove(filename.c_str());
+	remove(copy.c_str());
+	rmdir(directory.c_str());
+}
+
+// Replaces the whole of line 1 with `word` as one undo step
+static void retype(TextEditor& editor, const string& word) {
+	editor.exCommand("s/.*/" + word + "/");
+	editor.sealUndoStep();
+}
+
+static void testUndoLimitDropsOldest() {
+	string filename = scratchFile("undolimit");
+	writeFile(filename, "start\n");
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.loadFromFile(filename);
+
+	editor.exCommand("set undolimit");
+	check(editor.statusMessage() == "undolimit=" + to_string(UndoHistory::DEFAULT_LIMIT), "set undolimit without a value shows it");
+	editor.exCommand("set undolimit=12k");
+	check(!editor.takeFailure() && editor.statusMessage() == "undolimit=12288", "undolimit takes a k suffix");
+	editor.exCommand("set undolimit=99999999999999999999999");
+	check(editor.takeFailure(), "an undolimit that overflows is rejected");
+	editor.exCommand("set undolevels=3");
+	check(editor.takeFailure(), "unknown options are rejected");
+
+	// Eight steps of about 2 KB each need more than 12 KB, so the first
+	// ones are dropped as the later ones are recorded
+	for (char c = 'a'; c < 'i'; ++c) {
+		retype(editor, string(1024, c));
+	}
+	size_t undone = 0;
+	for (;;) {
+		editor.undo();
+		if (editor.statusMessage() == "Already at oldest change") break;
+		undone++;
+	}
+	check(undone > 0 && undone < 8, "a small undolimit keeps only the newest steps");
+	check(contentOf(editor) != "start\n", "the oldest change can no longer be undone");
+
+	// Lowering the limit drops history that is already recorded
+	for (size_t i = 0; i < undone; ++i) {
+		editor.redo();
+	}
+	editor.exCommand("set undolimit=0");
+	editor.undo();
+	check(editor.statusMessage() == "Already at oldest change", "lowering undolimit drops the recorded history");
+	check(contentOf(editor) == string(1024, 'h') + "\n", "dropping history leaves the text alone");
+	remove(filename.c_str());
+}
+
+// Scripted mode runs editors on worker threads, away from any terminal
+static void testHeadlessEditor() {
+	string filename = scratchFile("headless");
+	writeFile(filename, "one\n");
+	{
+		TextEditor editor;
+		editor.useSideFiles(false);
+		editor.loadFromFile(filename);
+		editor.exCommand("s/one/two/");
+		editor.saveToFile(filename);
+	}
+	struct sigaction action;
+	sigaction(SIGWINCH, nullptr, &action);
+	check(action.sa_handler == SIG_DFL, "an editor that never draws leaves SIGWINCH alone");
+	remove(filename.c_str());
+}
+
+// A file with another hard link is rewritten in place, and a mapped text
+// keeps reading its old bytes while the file under it changes.
+static void testSaveKeepsHardLinks() {
+	string filename = scratchFile("linked");
+	string other = scratchFile("link");
+	string content;
+	for (int i = 0; content.size() < size_t(FileManager::LARGE_FILE_BYTES); ++i) {
+		content += "line " + to_string(i) + "\n";
+	}
+	writeFile(filename, content);
+	link(filename.c_str(), other.c_str());
+	struct stat before;
+	stat(filename.c_str(), &before);
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.loadFromFile(filename);
+
+	editor.deleteCharacterAtCursor();
+	editor.saveToFile(filename);
+	string saved;
+	FileManager::readFile(other, saved);
+	struct stat after;
+	stat(filename.c_str(), &after);
+	check(saved == content.substr(1), "the other link sees the saved text");
+	check(after.st_ino == before.st_ino, "saving keeps a linked file's inode");
+	check(contentOf(editor) == content.substr(1), "the text survives its file being rewritten");
+	remove(filename.c_str());
+	remove(other.c_str());
+}
+
+// :r counts the lines it reads the way they are saved
+static void testReadCountsLines() {
+	string filename = scratchFile("read");
+	string other = scratchFile("read_other");
+	writeFile(filename, "top\n");
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.loadFromFile(filename);
+
+	writeFile(other, "");
+	editor.readIntoText(other);
+	check(editor.statusMessage() == "Read 0 lines from " + other, "an empty file reads as 0 lines");
+	check(contentOf(editor) == "top\n", "reading an empty file adds nothing");
+	writeFile(other, "a\nb\n");
+	editor.readIntoText(other);
+	check(editor.statusMessage() == "Read 2 lines from " + other, "a final newline ends the last line");
+	writeFile(other, "c");
+	editor.readIntoText(other);
+	check(editor.statusMessage() == "Read 1 lines from " + other, "a last line without a newline counts");
+	check(contentOf(editor) == "top\na\nc\nb\n", "read lines go below the cursor line");
+	remove(filename.c_str());
+	remove(other.c_str());
+}
+
+static void testPastesShareRegister() {
+	string filename = scratchFile("paste");
+	string line(100000, 'p');
+	writeFile(filename, line + "\n");
+	TextEditor editor;
+	editor.useSideFiles(false);
+	editor.loadFromFile(filename);
+
+	editor.yankLines(1);
+	size_t before = editor.memoryUsage();
+	for (int i = 0; i < 10; ++i) {
+		editor.pasteAfter();
+	}
+	string pasted;
+	for (int i = 0; i < 11; ++i) {
+		pasted += line + "\n";
+	}
+	check(contentOf(editor) == pasted, "each paste puts the register's lines in the text");
+	check(editor.memoryUsage() - before < 4 * line.size(), "pastes of one register share its text");
+
+	for (int i = 0; i < 10; ++i) {
+		editor.undo();
+	}
+	check(contentOf(editor) == line + "\n", "undo takes back shared pastes");
+	for (int i = 0; i < 10; ++i) {
+		editor.redo();
+	}
+	check(contentOf(editor) == pasted, "redo puts shared pastes back");
+	remove(filename.c_str());
+}
+
+static void testMacrosLiveInRegisters() {
+	string directory = scratchFile("macro");
+	mkdir(directory.c_str(), 0700);
+	writeFile(directory + "/m.txt", "abc\n");
+
+	// qa x q records x in "a, which "ap then puts below as a line. That
+	// line yanked into "b and replayed with @b on the first line runs x.
+	runKeys(directory, "m.txt", "qaxq\"ap\"byy\x1b[A@b:w n.txt\r");
+	string saved;
+	FileManager::readFile(directory + "/n.txt", saved);
+	check(saved == "c\nx\n", "macros and yanks share registers");
+	remove((directory + "/m.txt").c_str());
+	remove((directory + "/n.txt").c_str());
+	rmdir(directory.c_str());
+}
+
+// The hash put together from pieces matches hashing the text in one go
+static void testHashOfEditedText() {
+	string content;
+	for (size_t i = 0; content.size() < (3 << 20); ++i) {
+		content += "line " + to_string(i * 7919 % 100003) + "\n";
+	}
+	PieceTable text;
+	text.load(string(content));
+	text.prepareHash();
+	check(text.loadedHash() == ContentHash::of(text.loadedText()), "the loaded text hashes by blocks as in one go");
+
+	unsigned seed = 12345;
+	for (int i = 0; i < 200; ++i) {
+		seed = seed * 1103515245 + 12345;
+		size_t offset = seed % text.length();
+		if (i % 3 == 0) {
+			text.erase(offset, min<size_t>(seed % 40000, text.length() - offset));
+		}
+		else {
+			string inserted(seed % 50, 'a' + i % 26);
+			text.insert(offset, inserted.data(), inserted.size());
+		}
+	}
+	check(text.hash() == ContentHash::of(text.substr(0, text.length())), "an edited text hashes from its pieces as in one go");
+	check(text.hash() != ContentHash::of(content), "edits change the hash");
+}
+
+int main() {
+	testEnterSplitsLine();
+	testUndoLimitDropsOldest();
+	testHeadlessEditor();
+	testFindNextKeepsText();
+	testHashOfEditedText();
+	testPastesShareRegister();
+	testMacrosLiveInRegisters();
+	testSaveKeepsHardLinks();
+	testReadCountsLines();
+	if (failures == 0) {
+		cout << "All tests passed" << endl;
+	}
+	return failures == 0 ? 0 : 1;
+}